@@ -0,0 +1,150 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+
+/*
+ * bench-bwlimit: measure the overhead of bwlimit_wait() per call and
+ * the accuracy of the rate at 1, 10, and 100 Gbps, with multiple
+ * threads calling bwlimit_wait() as copy threads do.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <bwlimit.h>
+
+struct bench {
+	struct bwlimit bw;
+	size_t len; /* bytes per bwlimit_wait() call */
+	double duration; /* sec */
+	volatile bool stop;
+};
+
+struct result {
+	pthread_t tid;
+	struct bench *b;
+	volatile size_t calls;
+};
+
+static double now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (double)ts.tv_nsec / 1000000000;
+}
+
+static void *bench_thread(void *arg)
+{
+	struct result *r = arg;
+
+	while (!r->b->stop) {
+		bwlimit_wait(&r->b->bw, r->b->len);
+		r->calls++;
+	}
+	return NULL;
+}
+
+static size_t sum_calls(struct result *r, int nr_threads)
+{
+	size_t calls = 0;
+	int n;
+
+	for (n = 0; n < nr_threads; n++)
+		calls += r[n].calls;
+	return calls;
+}
+
+static double run(struct bench *b, uint64_t bps, struct result *r, int nr_threads)
+{
+	double start, elapsed;
+	size_t calls;
+	int n;
+
+	bwlimit_init(&b->bw, bps, 100);
+	b->stop = false;
+
+	for (n = 0; n < nr_threads; n++) {
+		r[n].b = b;
+		r[n].calls = 0;
+		pthread_create(&r[n].tid, NULL, bench_thread, &r[n]);
+	}
+
+	/* skip the initial burst of the bucket (100 msec) */
+	usleep(200000);
+
+	start = now_sec();
+	calls = sum_calls(r, nr_threads);
+	usleep(b->duration * 1000000);
+	calls = sum_calls(r, nr_threads) - calls;
+	elapsed = now_sec() - start;
+
+	b->stop = true;
+	for (n = 0; n < nr_threads; n++)
+		pthread_join(r[n].tid, NULL);
+
+	return calls / elapsed;
+}
+
+void usage(void)
+{
+	printf("usage: bench-bwlimit [-t nr_threads] [-d duration] [-l len]\n"
+	       "    -t NR_THREADS  threads calling bwlimit_wait() (default 8)\n"
+	       "    -d DURATION    seconds for each rate (default 2)\n"
+	       "    -l LEN         bytes per call (default 16384)\n");
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t rates[] = { 1000000000ULL, 10000000000ULL, 100000000000ULL };
+	struct bench b = { .len = 16384, .duration = 2 };
+	struct result *r;
+	int nr_threads = 8, ch, n;
+	double cps, bps;
+
+	while ((ch = getopt(argc, argv, "t:d:l:h")) != -1) {
+		switch (ch) {
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		case 'd':
+			b.duration = atof(optarg);
+			break;
+		case 'l':
+			b.len = atol(optarg);
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	if (nr_threads < 1 || b.duration <= 0 || b.len < 1) {
+		usage();
+		return 1;
+	}
+
+	if (!(r = calloc(nr_threads, sizeof(*r)))) {
+		perror("calloc");
+		return 1;
+	}
+
+	printf("%d threads, %zu bytes per call, %.1f sec\n", nr_threads, b.len, b.duration);
+
+	/* overhead: a rate high enough not to sleep */
+	cps = run(&b, UINT64_MAX / 8000000000ULL * 1000000000ULL, r, nr_threads);
+	printf("%-10s %12.0f calls/s %10.1f ns/call/thread\n", "unlimited", cps,
+	       1000000000 / (cps / nr_threads));
+
+	for (n = 0; n < sizeof(rates) / sizeof(rates[0]); n++) {
+		cps = run(&b, rates[n], r, nr_threads);
+		bps = cps * b.len * 8;
+		printf("%-10.0fG %12.0f calls/s %10.3f Gbps %+8.2f%%\n",
+		       (double)rates[n] / 1000000000, cps, bps / 1000000000,
+		       (bps - rates[n]) * 100 / rates[n]);
+	}
+
+	free(r);
+	return 0;
+}
@@ -27,7 +27,9 @@
  */
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <limits.h>
+#include <stdint.h>
 
 #define MSCP_DIRECTION_L2R	1	/** Indicates local to remote copy */
 #define MSCP_DIRECTION_R2L	2	/** Indicates remote to local copy */
@@ -43,9 +45,36 @@ struct mscp_opts {
 	size_t	max_chunk_sz;	/** maximum chunk size (default file size/nr_threads) */
 	size_t	buf_sz;		/** buffer size, default 16k. */
 	size_t	bitrate;	/** bits-per-seconds to limit bandwidth */
+	size_t	bitrate_per_nic; /** bits-per-seconds to limit bandwidth of
+				  *  each network device */
+	size_t	bitrate_per_conn; /** bits-per-seconds to limit bandwidth of
+				   *  each connection */
+	char	*bwlimit_group;	/** name of a group of processes sharing the
+				 *  bandwidth limit. bitrate, if not 0, sets
+				 *  the limit of the group */
+	char	*control_sock;	/** path to unix domain socket to control
+				 *  the transfer at runtime */
+	int	metrics_port;	/** serve Prometheus metrics over http on
+				 *  127.0.0.1:metrics_port, 0 disables */
+	char	*metrics_file;	/** write Prometheus metrics to the file
+				 *  periodically, for node_exporter */
+	char	*trace;		/** write a timeline of events to the file
+				 *  in Chrome trace format on mscp_free() */
+	size_t	dev_size;	/** read character devices given as sources,
+				 *  e.g., /dev/zero, as dev_size bytes files,
+				 *  for benchmarks. 0 skips devices */
 	char	*coremask;	/** hex to specifiy usable cpu cores */
 	int	max_startups;	/** sshd MaxStartups concurrent connections */
 	int     interval;	/** interval between SSH connection attempts */
+	bool	adaptive_conns;	/** scale connections up to nr_threads while
+				 *  throughput improves */
+	int	max_retries;	/** reconnections allowed on connection
+				 *  failures (default 16, -1 disables) */
+	int	stall_timeout;	/** seconds without progress to tear down a
+				 *  connection (default 60, -1 disables) */
+	char	*remote_addrs;	/** comma-separated addresses of the remote
+				 *  host, or DEV=ADDR pairs, to distribute
+				 *  connections over */
 	bool	preserve_ts;	/** preserve file timestamps */
 	int	severity; 	/** messaging severity. set MSCP_SERVERITY_* */
 };
@@ -69,6 +98,11 @@ struct mscp_ssh_opts {
 	char	*compress;	/** yes, no, zlib@openssh.com */
 	char	*ccalgo;	/** TCP cc algorithm */
 	char	*bind_dev;	/** network device to bind socket to */
+	char	*remote_addr;	/** address to connect to instead of the host,
+				 *  set for each connection by mscp */
+	char	*loopback;	/** connect to the in-process sftp server
+				 *  emulating "rtt=MSEC,rate=BPS,loss=PCT"
+				 *  instead of the host, for benchmarks */
 
 	char	*password;	/** password auth passowrd */
 	char	*passphrase;	/** passphrase for private key */
@@ -95,6 +129,111 @@ struct mscp_ssh_opts {
 struct mscp_stats {
 	size_t total;	/** total bytes to be transferred */
 	size_t done;	/** total bytes transferred */
+	size_t retries;	/** number of reconnections after connection failures */
+	size_t stalls;	/** number of stalled connections torn down */
+};
+
+
+/** Version of struct mscp_stats_ext. 2 adds tm to mscp_thread_stats */
+#define MSCP_STATS_VERSION	2
+
+/** Number of buckets of latency histograms. see mscp_lat_hist_usec() */
+#define MSCP_LAT_HIST_BUCKETS	240
+
+/** States of copy threads */
+enum {
+	MSCP_THREAD_STATE_INIT		= 0,
+	MSCP_THREAD_STATE_CONNECTING	= 1,
+	MSCP_THREAD_STATE_RUNNING	= 2,
+	MSCP_THREAD_STATE_DONE		= 3,
+};
+
+/** What limits the throughput of a connection. see mscp_bottleneck_str() */
+enum {
+	MSCP_BOTTLENECK_UNKNOWN	= 0,	/** not sampled yet, or idle */
+	MSCP_BOTTLENECK_CPU	= 1,	/** the thread is busy on cpu, e.g., ciphers */
+	MSCP_BOTTLENECK_DISK	= 2,	/** reading or writing local files */
+	MSCP_BOTTLENECK_NETWORK	= 3,	/** RTT, congestion window, or losses */
+	MSCP_BOTTLENECK_REMOTE	= 4,	/** receive window of the remote host */
+	MSCP_BOTTLENECK_BWLIMIT	= 5,	/** sleeping for bitrate limits */
+	MSCP_BOTTLENECK_NR,
+};
+
+/**
+ * @struct	mscp_conn_telemetry
+ * @brief	Telemetry of a connection. The copy thread samples
+ *		TCP_INFO of its socket and its cpu time every second,
+ *		and classifies the bottleneck of the last interval.
+ *		TCP_INFO is available on linux only.
+ */
+struct mscp_conn_telemetry {
+	uint32_t rtt;		/** smoothed RTT (usec) */
+	uint32_t rttvar;	/** RTT variance (usec) */
+	uint32_t cwnd;		/** congestion window (segments) */
+	uint32_t retrans;	/** segments retransmitted in total */
+	uint64_t delivery_rate;	/** bytes/sec estimated by TCP, 0 if unknown */
+	uint64_t pacing_rate;	/** bytes/sec */
+
+	/** followings are ratios to the last interval */
+	double	cpu_user;	/** user cpu time of the thread */
+	double	cpu_sys;	/** system cpu time of the thread */
+	double	disk;		/** time in disk reads and writes */
+	double	wait;		/** time sleeping for bitrate limits */
+	double	loss;		/** segments retransmitted per segment sent */
+	double	rwnd_limited;	/** time limited by the receive window */
+
+	int	bottleneck;	/** MSCP_BOTTLENECK_* of the last interval */
+	/** number of intervals classified into each MSCP_BOTTLENECK_* */
+	uint32_t intervals[MSCP_BOTTLENECK_NR];
+};
+
+/**
+ * @struct	mscp_thread_stats
+ * @brief	Structure to get statistics of a copy thread
+ */
+struct mscp_thread_stats {
+	int	id;		/** thread id */
+	int	state;		/** MSCP_THREAD_STATE_* */
+	const char *netdev;	/** network device bound to, or NULL */
+	const char *remote_addr; /** remote address connected to, or NULL */
+	size_t	bytes;		/** bytes transferred */
+	size_t	chunks;		/** chunks copied */
+	const char *chunk_path;	/** source path of the chunk being copied,
+				 *  or NULL. valid until mscp_cleanup() */
+	size_t	chunk_off;	/** offset of the chunk being copied */
+	size_t	chunk_len;	/** length of the chunk being copied */
+
+	struct mscp_conn_telemetry tm; /** telemetry (version 2 or later) */
+};
+
+/**
+ * @struct	mscp_stats_ext
+ * @brief	Structure to get extended mscp statistics. Set version
+ *		to MSCP_STATS_VERSION, and threads to an array of
+ *		max_threads entries (or NULL) before mscp_get_stats_ext().
+ */
+struct mscp_stats_ext {
+	int	version;	/** MSCP_STATS_VERSION, set by caller */
+
+	size_t	total;		/** total bytes to be transferred */
+	size_t	done;		/** total bytes transferred */
+	size_t	retries;	/** number of reconnections */
+	size_t	stalls;		/** number of stalled connections torn down */
+
+	bool	scan_done;	/** scanning source files finished */
+	size_t	files_total;	/** files found by scan so far */
+	size_t	files_done;	/** files transferred */
+	size_t	files_inflight;	/** files being transferred */
+
+	/** histogram of SFTP request latency. lat_hist[n] is the
+	 *  number of requests completed in mscp_lat_hist_usec(n) usec
+	 *  or more, and less than mscp_lat_hist_usec(n + 1) */
+	size_t	lat_hist[MSCP_LAT_HIST_BUCKETS];
+
+	int	nr_threads;	/** number of copy threads */
+	int	max_threads;	/** length of threads, set by caller */
+	struct mscp_thread_stats *threads; /** stats of copy threads, set by
+					    *  caller */
 };
 
 
@@ -249,6 +388,43 @@ void mscp_stop(struct mscp *m);
  */
 int mscp_join(struct mscp *m);
 
+/**
+ * @brief Change the bitrate limit while copying. If the mscp
+ * instance is in a bwlimit group, this changes the limit of the group.
+ *
+ * @param m		mscp instance.
+ * @param bitrate	bits-per-seconds, 0 means no limit.
+ *
+ * @return 		0 on success, < 0 if an error occured.
+ */
+int mscp_set_bitrate(struct mscp *m, size_t bitrate);
+
+/**
+ * @brief Change the number of copy threads while copying. Threads
+ * removed exit after copying their current chunks.
+ *
+ * @param m		mscp instance.
+ * @param nr_threads	number of copy threads.
+ *
+ * @return 		0 on success, < 0 if an error occured.
+ */
+int mscp_set_nr_threads(struct mscp *m, int nr_threads);
+
+/**
+ * @brief Pause dispatching chunks to copy threads. Chunks being
+ * copied are not interrupted.
+ *
+ * @param m		mscp instance.
+ */
+void mscp_pause(struct mscp *m);
+
+/**
+ * @brief Resume dispatching chunks paused by mscp_pause().
+ *
+ * @param m		mscp instance.
+ */
+void mscp_resume(struct mscp *m);
+
 /**
  * @brief Get statistics of copy.
  *
@@ -257,6 +433,33 @@ int mscp_join(struct mscp *m);
  */
 void mscp_get_stats(struct mscp *m, struct mscp_stats *s);
 
+/**
+ * @brief Get extended statistics of copy. Counters are read without
+ * stopping copy threads.
+ *
+ * @param m		mscp instance.
+ * @param s[in,out]	extended statistics. version, max_threads, and
+ *			threads must be set.
+ *
+ * @return 		0 on success, < 0 if an error occured.
+ */
+int mscp_get_stats_ext(struct mscp *m, struct mscp_stats_ext *s);
+
+/**
+ * @brief Return the lower bound of a bucket of latency histograms in
+ * usec. Buckets are log-linear with 12.5% precision.
+ *
+ * @param bucket	index of the bucket.
+ */
+size_t mscp_lat_hist_usec(int bucket);
+
+/**
+ * @brief Return the name of MSCP_BOTTLENECK_*, e.g., "cpu".
+ *
+ * @param bottleneck	MSCP_BOTTLENECK_*.
+ */
+const char *mscp_bottleneck_str(int bottleneck);
+
 /**
  * @brief Cleanup the mscp instance. Before calling mscp_cleanup(),
  * must call mscp_join(). After mscp_cleanup() called, the mscp
@@ -1,94 +1,310 @@
 /* SPDX-License-Identifier: GPL-3.0-only */
 #include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <bwlimit.h>
+#include <minmax.h>
 #include <platform.h>
+#include <strerrno.h>
+#include <trace.h>
 
-#define timespeczerorize(ts)    \
-	do {                    \
-		ts.tv_sec = 0;  \
-		ts.tv_nsec = 0; \
-	} while (0)
+/* a thread takes credits for 1 msec at once from the bucket */
+#define BWLIMIT_BATCH_USEC 1000
 
-int bwlimit_init(struct bwlimit *bw, uint64_t bps, uint64_t win)
+/* credits taken by this thread. a thread can use a few bwlimit
+ * instances at a time. */
+#define BWLIMIT_NR_SLOTS 4
+static __thread struct {
+	struct bwlimit *bw;
+	size_t credit;
+} slots[BWLIMIT_NR_SLOTS];
+static __thread unsigned int slot_next;
+
+static uint64_t bwlimit_batch(uint64_t bps)
 {
-	if (!(bw->sem = sem_create(1)))
-		return -1;
+	return max((double)bps / 8 / 1000000 * BWLIMIT_BATCH_USEC, 1);
+}
 
+int bwlimit_init(struct bwlimit *bw, uint64_t bps, uint64_t win)
+{
+	bw->tat = 0;
 	bw->bps = bps;
 	bw->win = win; /* msec window */
-	bw->amt = (double)bps / 8 / 1000 * win; /* bytes in a window (msec) */
-	bw->credit = bw->amt;
-	timespeczerorize(bw->wstart);
-	timespeczerorize(bw->wend);
+	bw->batch = bwlimit_batch(bps);
+	bw->parent = NULL;
+	bw->group = NULL;
+	bw->member = -1;
+	bw->refresh = 0;
 
 	return 0;
 }
 
-#define timespecisset(ts) ((ts).tv_sec || (ts).tv_nsec)
-
-#define timespecmsadd(a, msec, r)                                \
-	do {                                                     \
-		(r).tv_sec = (a).tv_sec;                         \
-		(r).tv_nsec = (a).tv_nsec + (msec * 1000000);    \
-		if ((r).tv_nsec > 1000000000) {                  \
-			(r).tv_sec += (r.tv_nsec) / 1000000000L; \
-			(r).tv_nsec = (r.tv_nsec) % 1000000000L; \
-		}                                                \
-	} while (0)
-
-#define timespecsub(a, b, r)                             \
-	do {                                             \
-		(r).tv_sec = (a).tv_sec - (b).tv_sec;    \
-		(r).tv_nsec = (a).tv_nsec - (b).tv_nsec; \
-		if ((r).tv_nsec < 0) {                   \
-			(r).tv_sec -= 1;                 \
-			(r).tv_nsec += 1000000000;       \
-		}                                        \
-	} while (0)
-
-#define timespeccmp(a, b, expr) \
-	((a.tv_sec * 1000000000 + a.tv_nsec) expr(b.tv_sec * 1000000000 + b.tv_nsec))
+void bwlimit_set_rate(struct bwlimit *bw, uint64_t bps)
+{
+	bw->batch = bwlimit_batch(bps);
+	bw->bps = bps;
+}
 
-#include <stdio.h>
+static uint64_t now_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t end)
+{
+	struct timespec rq;
+	uint64_t now;
+
+	while ((now = now_nsec()) < end) {
+		rq.tv_sec = (end - now) / 1000000000;
+		rq.tv_nsec = (end - now) % 1000000000;
+		if (nanosleep(&rq, NULL) < 0 && errno != EINTR)
+			break;
+	}
+}
 
-int bwlimit_wait(struct bwlimit *bw, size_t nr_bytes)
+static uint64_t bwlimit_take(struct bwlimit *bw, size_t nr_bytes)
 {
-	struct timespec now, end, rq, rm;
+	uint64_t burst = bw->win * 1000000, bps = bw->bps, cost, old, new, now, base;
 
-	if (bw->bps == 0)
-		return 0; /* no bandwidth limit */
+	if (bps == 0)
+		return 0; /* the limit is removed by bwlimit_set_rate() */
+	cost = (double)nr_bytes * 8 * 1000000000 / bps;
 
-	if (sem_wait(bw->sem) < 0)
-		return -1;
+	/* tat does not go behind now, so that an idle bucket is filled
+	 * up to the burst, not more. */
+	do {
+		old = bw->tat;
+		now = now_nsec();
+		base = max(old, now);
+		new = base + cost;
+	} while (!__sync_bool_compare_and_swap(&bw->tat, old, new));
 
-	clock_gettime(CLOCK_MONOTONIC, &now);
+	/* returns when the caller can send the bytes */
+	return new > now + burst ? new - burst : 0;
+}
+
+static uint64_t bwlimit_consume(struct bwlimit *bw, size_t nr_bytes)
+{
+	uint64_t until = 0;
+	size_t take;
+	int n;
 
-	if (!timespecisset(bw->wstart)) {
-		bw->wstart = now;
-		timespecmsadd(bw->wstart, bw->win, bw->wend);
+	for (n = 0; n < BWLIMIT_NR_SLOTS; n++) {
+		if (slots[n].bw == bw)
+			break;
 	}
+	if (n == BWLIMIT_NR_SLOTS) {
+		/* credits left in the evicted slot are just dropped */
+		n = slot_next++ % BWLIMIT_NR_SLOTS;
+		slots[n].bw = bw;
+		slots[n].credit = 0;
+	}
+
+	if (slots[n].credit < nr_bytes) {
+		take = max(nr_bytes - slots[n].credit, bw->batch);
+		until = bwlimit_take(bw, take);
+		slots[n].credit += take;
+	}
+	slots[n].credit -= nr_bytes;
+
+	return until;
+}
+
+static void bwlimit_group_refresh(struct bwlimit *bw);
+
+uint64_t bwlimit_wait(struct bwlimit *bw, size_t nr_bytes)
+{
+	uint64_t until = 0, t, now;
+
+	if (bw->group)
+		bwlimit_group_refresh(bw);
+
+	for (; bw; bw = bw->parent) {
+		if (bw->bps == 0)
+			continue; /* no bandwidth limit */
+		t = bwlimit_consume(bw, nr_bytes);
+		until = max(until, t);
+	}
+
+	if (!until)
+		return 0;
+
+	t = trace_begin();
+	now = now_nsec();
+	sleep_until(until);
+	trace_event("bwlimit", t, NULL, 0, nr_bytes);
+
+	return until > now ? until - now : 0;
+}
+
+
+/* bandwidth limit shared among processes */
+
+#define BWLIMIT_GROUP_MAGIC		0x6d736370 /* mscp */
+#define BWLIMIT_GROUP_NR_MEMBERS	64
+#define BWLIMIT_GROUP_REFRESH_MSEC	100
+#define BWLIMIT_GROUP_ACTIVE_MSEC	1000 /* transferring if waited within it */
+
+struct bwlimit_group {
+	uint32_t	magic;	/* set after initialized */
+	struct bwlimit	bw;	/* the bucket shared by processes */
+	struct {
+		pid_t		pid;	/* 0 if not used */
+		uint64_t	last;	/* last time the process waited (nsec) */
+	} __attribute__((aligned(64))) members[BWLIMIT_GROUP_NR_MEMBERS];
+};
 
-	bw->credit -= nr_bytes;
-
-	if (bw->credit < 0) {
-		/* no more credit on this window. sleep until the end
-		 * of this window + additional time for the remaining
-		 * bytes. */
-		uint64_t addition = (double)(bw->credit * -1) / (bw->bps / 8);
-		timespecmsadd(bw->wend, addition * 1000, end);
-		if (timespeccmp(end, now, >)) {
-			timespecsub(end, now, rq);
-			while (nanosleep(&rq, &rm) == -1) {
-				if (errno != EINTR)
-					break;
-				rq = rm;
+static void bwlimit_group_refresh(struct bwlimit *bw)
+{
+	struct bwlimit_group *g = bw->group;
+	uint64_t now = now_nsec(), refresh = bw->refresh, bps;
+	int n, active = 0;
+
+	if (now < refresh ||
+	    !__sync_bool_compare_and_swap(&bw->refresh, refresh,
+					  now + BWLIMIT_GROUP_REFRESH_MSEC * 1000000))
+		return; /* other thread refreshes */
+
+	g->members[bw->member].last = now;
+	for (n = 0; n < BWLIMIT_GROUP_NR_MEMBERS; n++) {
+		if (g->members[n].pid &&
+		    g->members[n].last + BWLIMIT_GROUP_ACTIVE_MSEC * 1000000 > now)
+			active++;
+	}
+
+	bps = g->bw.bps / active;
+	if (bps != bw->bps)
+		bwlimit_set_rate(bw, bps);
+}
+
+static int bwlimit_group_join(struct bwlimit_group *g)
+{
+	pid_t pid, self = getpid();
+	int n;
+
+	for (n = 0; n < BWLIMIT_GROUP_NR_MEMBERS; n++) {
+		pid = g->members[n].pid;
+		/* reuse slots of processes that exited without detaching */
+		if (pid && (kill(pid, 0) == 0 || errno != ESRCH))
+			continue;
+		if (__sync_bool_compare_and_swap(&g->members[n].pid, pid, self)) {
+			g->members[n].last = now_nsec();
+			return n;
+		}
+	}
+
+	priv_set_errv("bwlimit group is full: %d processes", BWLIMIT_GROUP_NR_MEMBERS);
+	return -1;
+}
+
+struct bwlimit *bwlimit_group_attach(const char *name, uint64_t bps, uint64_t win)
+{
+	struct bwlimit_group *g;
+	struct bwlimit *bw;
+	char shm_name[64];
+	bool created = true;
+	struct stat st;
+	int fd, n;
+
+	if (strchr(name, '/')) {
+		priv_set_errv("invalid bwlimit group name: %s", name);
+		return NULL;
+	}
+	snprintf(shm_name, sizeof(shm_name), "/mscp-bwlimit-%s", name);
+
+	fd = shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0 && errno == EEXIST) {
+		created = false;
+		fd = shm_open(shm_name, O_RDWR, 0600);
+	}
+	if (fd < 0) {
+		priv_set_errv("shm_open: %s: %s", shm_name, strerrno());
+		return NULL;
+	}
+
+	if (created) {
+		if (ftruncate(fd, sizeof(*g)) < 0) {
+			priv_set_errv("ftruncate: %s: %s", shm_name, strerrno());
+			goto close_out;
+		}
+	} else {
+		/* wait for the creator to size the segment */
+		for (n = 0; n < 100; n++) {
+			if (fstat(fd, &st) < 0) {
+				priv_set_errv("fstat: %s: %s", shm_name, strerrno());
+				goto close_out;
 			}
+			if (st.st_size == sizeof(*g))
+				break;
+			usleep(10000);
+		}
+		if (st.st_size != sizeof(*g)) {
+			priv_set_errv("invalid bwlimit group: %s", shm_name);
+			goto close_out;
 		}
-		bw->credit = bw->amt;
-		timespeczerorize(bw->wstart);
 	}
 
-	sem_post(bw->sem);
-	return 0;
+	g = mmap(NULL, sizeof(*g), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (g == MAP_FAILED) {
+		priv_set_errv("mmap: %s: %s", shm_name, strerrno());
+		goto close_out;
+	}
+	close(fd);
+
+	if (created) {
+		bwlimit_init(&g->bw, bps, win);
+		__sync_synchronize();
+		g->magic = BWLIMIT_GROUP_MAGIC;
+	} else {
+		for (n = 0; n < 100 && g->magic != BWLIMIT_GROUP_MAGIC; n++)
+			usleep(10000);
+		if (g->magic != BWLIMIT_GROUP_MAGIC) {
+			priv_set_errv("invalid bwlimit group: %s", shm_name);
+			goto unmap_out;
+		}
+		if (bps)
+			bwlimit_set_rate(&g->bw, bps);
+	}
+
+	if (posix_memalign((void **)&bw, 64, sizeof(*bw)) != 0) {
+		priv_set_errv("posix_memalign: %s", strerrno());
+		goto unmap_out;
+	}
+	bwlimit_init(bw, 0, win);
+	bwlimit_set_parent(bw, &g->bw);
+	bw->group = g;
+	if ((bw->member = bwlimit_group_join(g)) < 0) {
+		free(bw);
+		goto unmap_out;
+	}
+	bwlimit_group_refresh(bw);
+
+	return bw;
+
+unmap_out:
+	munmap(g, sizeof(*g));
+	return NULL;
+
+close_out:
+	close(fd);
+	return NULL;
+}
+
+void bwlimit_group_detach(struct bwlimit *bw)
+{
+	struct bwlimit_group *g = bw->group;
+
+	g->members[bw->member].pid = 0;
+	munmap(g, sizeof(*g));
+	free(bw);
 }
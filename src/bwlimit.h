@@ -6,23 +6,65 @@
 #include <stdint.h>
 #include <sys/types.h>
 #include <time.h>
-#include <semaphore.h>
+
+/*
+ * bwlimit is a token bucket without locks. The bucket is represented
+ * by a virtual time, tat (theoretical arrival time): sending n bytes
+ * advances tat by the time to send n bytes at bps, and the sender
+ * sleeps until tat - burst. tat is advanced by compare-and-swap, and
+ * senders sleep without holding anything.
+ *
+ * To avoid touching the shared tat on each call, each thread takes
+ * credits from the bucket in a batch (bytes for BWLIMIT_BATCH_USEC
+ * at bps), and consumes them locally.
+ *
+ * Buckets can be stacked by parent, e.g., a connection, a network
+ * device, and global. bwlimit_wait() takes credits from the bucket
+ * and all its ancestors, and sleeps once until all of them allow.
+ * Buckets with bps 0 are skipped.
+ *
+ * A bucket can be shared among processes through a POSIX shared
+ * memory segment named by a group. bwlimit_group_attach() creates or
+ * opens the group, and returns a bucket for this process whose parent
+ * is the shared one. The rate of the bucket for this process is the
+ * rate of the group divided by the number of processes transferring,
+ * so that the group bandwidth is shared fairly among processes.
+ */
+
+struct bwlimit_group;
 
 struct bwlimit {
-	sem_t		*sem;	/* semaphore */
-	uint64_t	bps;	/* limit bit-rate (bps) */
-	uint64_t	win;	/* window size (msec) */
-	size_t		amt;	/* amount of bytes can be sent in a window */
+	uint64_t	tat __attribute__((aligned(64))); /* virtual time (nsec) */
+	uint64_t	bps __attribute__((aligned(64))); /* limit bit-rate (bps) */
+	uint64_t	win;	/* window size (msec), the burst of the bucket */
+	uint64_t	batch;	/* bytes taken by a thread at once */
+
+	struct bwlimit	*parent; /* upper bucket, or NULL */
 
-	ssize_t		credit;	/* remaining bytes can be sent in a window */
-	struct timespec wstart, wend; /* window start time and end time */
+	/* for the bucket of this process in a group */
+	struct bwlimit_group	*group;
+	int		member;	 /* index of this process in the group */
+	uint64_t	refresh; /* next time to refresh bps (nsec) */
 };
 
 int bwlimit_init(struct bwlimit *bw, uint64_t bps, uint64_t win);
-/* if bps is 0, it means that bwlimit is not active. If so,
- * bwlimit_wait() returns immediately. */
+/* if bps is 0, it means that bwlimit is not active. If so, and no
+ * ancestors are active, bwlimit_wait() returns immediately. */
+
+#define bwlimit_set_parent(bw, p) ((bw)->parent = (p))
+
+/* change the rate of the bucket. it can be called while other threads
+ * are waiting on the bucket. */
+void bwlimit_set_rate(struct bwlimit *bw, uint64_t bps);
+
+/* attach to the bandwidth limit shared by a group of processes. if bps
+ * is not 0, it also sets the rate of the group. returns a bucket for
+ * this process, or NULL on error. */
+struct bwlimit *bwlimit_group_attach(const char *name, uint64_t bps, uint64_t win);
+void bwlimit_group_detach(struct bwlimit *bw);
 
-int bwlimit_wait(struct bwlimit *bw, size_t nr_bytes);
+/* returns time slept (nsec) */
+uint64_t bwlimit_wait(struct bwlimit *bw, size_t nr_bytes);
 
 
 #endif /* _BWLIMIT_H_ */
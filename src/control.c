@@ -0,0 +1,197 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <print.h>
+#include <strerrno.h>
+#include <control.h>
+
+#define CONTROL_BUFSIZ 1024
+#define CONTROL_TIMEOUT_MSEC 1000 /* for a client to send a command */
+
+int control_open(const char *pathname)
+{
+	struct sockaddr_un sun;
+	int fd;
+
+	if (strlen(pathname) >= sizeof(sun.sun_path)) {
+		priv_set_errv("too long control socket path: %s", pathname);
+		return -1;
+	}
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strncpy(sun.sun_path, pathname, sizeof(sun.sun_path) - 1);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		priv_set_errv("socket: %s", strerrno());
+		return -1;
+	}
+
+	/* a socket left by a previous mscp does not prevent binding */
+	unlink(pathname);
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+		priv_set_errv("bind: %s: %s", pathname, strerrno());
+		goto err_out;
+	}
+
+	if (listen(fd, 4) < 0) {
+		priv_set_errv("listen: %s", strerrno());
+		goto err_out;
+	}
+
+	return fd;
+
+err_out:
+	close(fd);
+	return -1;
+}
+
+void control_close(int fd, const char *pathname)
+{
+	close(fd);
+	unlink(pathname);
+}
+
+static long control_atol_with_unit(const char *value)
+{
+	char *end;
+	long v;
+
+	v = strtol(value, &end, 10);
+	if (end == value || v < 0)
+		return -1;
+
+	switch (*end) {
+	case '\0':
+		return v;
+	case 'k':
+	case 'K':
+		v *= 1000;
+		break;
+	case 'm':
+	case 'M':
+		v *= 1000 * 1000;
+		break;
+	case 'g':
+	case 'G':
+		v *= 1000 * 1000 * 1000;
+		break;
+	default:
+		return -1;
+	}
+
+	return *(end + 1) == '\0' ? v : -1;
+}
+
+static int control_exec(struct mscp *m, char *cmd)
+{
+	char *arg;
+	long v;
+
+	if ((arg = strchr(cmd, ' '))) {
+		*arg = '\0';
+		arg++;
+	}
+
+	if (strcmp(cmd, "bitrate") == 0 && arg) {
+		if ((v = control_atol_with_unit(arg)) < 0) {
+			priv_set_errv("invalid bitrate: %s", arg);
+			return -1;
+		}
+		return mscp_set_bitrate(m, v);
+	}
+
+	if (strcmp(cmd, "threads") == 0 && arg) {
+		v = atoi(arg);
+		if (v < 1) {
+			priv_set_errv("invalid number of threads: %s", arg);
+			return -1;
+		}
+		return mscp_set_nr_threads(m, v);
+	}
+
+	if (strcmp(cmd, "pause") == 0 && !arg) {
+		mscp_pause(m);
+		return 0;
+	}
+
+	if (strcmp(cmd, "resume") == 0 && !arg) {
+		mscp_resume(m);
+		return 0;
+	}
+
+	if (strcmp(cmd, "checkpoint") == 0 && arg)
+		return mscp_checkpoint_save(m, arg);
+
+	priv_set_errv("invalid command: %s", cmd);
+	return -1;
+}
+
+static void control_handle(int fd, struct mscp *m)
+{
+	char buf[CONTROL_BUFSIZ], reply[CONTROL_BUFSIZ], *line, *nl;
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	size_t len = 0;
+	ssize_t ret;
+
+	while (poll(&pfd, 1, CONTROL_TIMEOUT_MSEC) > 0) {
+		ret = read(fd, buf + len, sizeof(buf) - len - 1);
+		if (ret <= 0)
+			return;
+		len += ret;
+		buf[len] = '\0';
+
+		line = buf;
+		while ((nl = strchr(line, '\n'))) {
+			*nl = '\0';
+			if (nl > line && *(nl - 1) == '\r')
+				*(nl - 1) = '\0';
+			if (*line) {
+				pr_notice("control: %s", line);
+				if (control_exec(m, line) < 0)
+					snprintf(reply, sizeof(reply), "error: %s\n", priv_get_err());
+				else
+					snprintf(reply, sizeof(reply), "ok\n");
+				if (write(fd, reply, strlen(reply)) < 0)
+					return;
+			}
+			line = nl + 1;
+		}
+
+		len -= line - buf;
+		memmove(buf, line, len);
+		if (len == sizeof(buf) - 1)
+			return; /* too long line */
+	}
+}
+
+int control_serve(int fd, struct mscp *m, int timeout_msec)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	int cfd, ret;
+
+	if ((ret = poll(&pfd, 1, timeout_msec)) <= 0) {
+		if (ret < 0 && errno != EINTR) {
+			priv_set_errv("poll: %s", strerrno());
+			return -1;
+		}
+		return 0;
+	}
+
+	if ((cfd = accept(fd, NULL, NULL)) < 0) {
+		priv_set_errv("accept: %s", strerrno());
+		return -1;
+	}
+
+	control_handle(cfd, m);
+	close(cfd);
+
+	return 0;
+}
@@ -0,0 +1,31 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+#ifndef _CONTROL_H_
+#define _CONTROL_H_
+
+#include <mscp.h>
+
+/*
+ * The control socket is a unix domain stream socket accepting one
+ * command per line, and replies "ok" or "error: reason" per line:
+ *
+ *   bitrate RATE      change the bitrate limit, n[KMG], 0 for no limit
+ *   threads N         change the number of copy threads
+ *   pause             stop dispatching chunks to copy threads
+ *   resume            resume dispatching chunks
+ *   checkpoint PATH   save a checkpoint to PATH
+ *
+ * Chunks being copied are not interrupted by any command.
+ */
+
+/* control_open() creates the control socket at pathname and returns
+ * the listening fd. */
+int control_open(const char *pathname);
+
+/* control_close() closes the fd and removes the socket. */
+void control_close(int fd, const char *pathname);
+
+/* control_serve() waits for a connection up to timeout_msec, and
+ * handles commands from the connection for the mscp instance. */
+int control_serve(int fd, struct mscp *m, int timeout_msec);
+
+#endif /* _CONTROL_H_ */
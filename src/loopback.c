@@ -0,0 +1,750 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+#include <config.h>
+#ifdef WITH_LOOPBACK
+#define WITH_SERVER 1 /* sftp_server_*() of libssh */
+#endif
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <loopback.h>
+#include <minmax.h>
+#include <print.h>
+#include <strerrno.h>
+
+#ifdef WITH_LOOPBACK
+
+#include "libssh/server.h"
+
+#define LO_MSS		1448		/* bytes of a segment to be lost */
+#define LO_PKT_SZ	65536		/* bytes relayed at once */
+#define LO_QUEUE_MIN	(1 << 20)	/* bytes in flight in addition to BDP */
+#define LO_QUEUE_MAX	(64 << 20)	/* bytes in flight without rate */
+#define LO_READDIR_NR	64		/* entries replied at once */
+
+/* the link between the client and the server */
+struct lo_link {
+	uint64_t	delay;	/* one-way delay (usec) */
+	double		rate;	/* bytes/usec, 0 means unlimited */
+	double		loss;	/* probability to lose a segment */
+	size_t		queue;	/* max bytes in flight per direction */
+
+	int		fd[2];	/* relay ends to the client and the server */
+	int		refcnt;	/* relays using the fds */
+};
+
+/* relay of a direction */
+struct lo_relay {
+	struct lo_link	*l;
+	int		in, out;
+	uint64_t	free_at;	/* the link finishes sending (usec) */
+	uint64_t	last_due;	/* data is delivered in order */
+	unsigned int	seed;
+};
+
+struct lo_pkt {
+	struct lo_pkt	*next;
+	uint64_t	due;	/* time to deliver (usec) */
+	size_t		len;
+	char		data[LO_PKT_SZ];
+};
+
+static uint64_t lo_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static struct lo_link *lo_link_new(const char *spec)
+{
+	char *s, *tok, *save, *v;
+	double rtt = 0, bps = 0, loss = 0, mathis;
+	struct lo_link *l;
+
+	if (!(s = strdup(spec))) {
+		priv_set_errv("strdup: %s", strerrno());
+		return NULL;
+	}
+
+	for (tok = strtok_r(s, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		if (strcmp(tok, "none") == 0)
+			continue;
+		if (!(v = strchr(tok, '=')))
+			goto invalid;
+		*v++ = '\0';
+		if (strcmp(tok, "rtt") == 0)
+			rtt = atof(v);
+		else if (strcmp(tok, "rate") == 0) {
+			bps = atof(v);
+			switch (v[strlen(v) - 1]) {
+			case 'k':
+			case 'K':
+				bps *= 1000;
+				break;
+			case 'm':
+			case 'M':
+				bps *= 1000 * 1000;
+				break;
+			case 'g':
+			case 'G':
+				bps *= 1000 * 1000 * 1000;
+				break;
+			}
+		} else if (strcmp(tok, "loss") == 0)
+			loss = atof(v) / 100;
+		else
+			goto invalid;
+	}
+	free(s);
+
+	if (rtt < 0 || bps < 0 || loss < 0 || loss >= 1) {
+		priv_set_errv("invalid loopback link: %s", spec);
+		return NULL;
+	}
+
+	if (!(l = calloc(1, sizeof(*l)))) {
+		priv_set_errv("calloc: %s", strerrno());
+		return NULL;
+	}
+	l->delay = rtt * 1000 / 2;
+	l->rate = bps / 8 / 1000000;
+	l->loss = loss;
+
+	/* TCP under losses does not go beyond MSS / RTT * 1.22 / sqrt(loss) */
+	if (loss > 0 && rtt > 0) {
+		mathis = LO_MSS / (rtt * 1000) * 1.22 / sqrt(loss);
+		l->rate = l->rate > 0 ? min(l->rate, mathis) : mathis;
+	}
+
+	l->queue = l->rate > 0 ? l->rate * l->delay * 2 + LO_QUEUE_MIN : LO_QUEUE_MAX;
+	l->fd[0] = l->fd[1] = -1;
+	return l;
+
+invalid:
+	priv_set_errv("invalid loopback link: %s", spec);
+	free(s);
+	return NULL;
+}
+
+static void lo_link_put(struct lo_link *l)
+{
+	if (__sync_sub_and_fetch(&l->refcnt, 1) > 0)
+		return;
+	close(l->fd[0]);
+	close(l->fd[1]);
+	free(l);
+}
+
+/* time to deliver len bytes received now */
+static uint64_t lo_schedule(struct lo_relay *r, size_t len, uint64_t now)
+{
+	struct lo_link *l = r->l;
+	uint64_t due;
+	size_t n;
+
+	/* send at the rate, and then propagate */
+	r->free_at = max(r->free_at, now);
+	if (l->rate > 0)
+		r->free_at += len / l->rate;
+	due = r->free_at + l->delay;
+
+	/* a lost segment arrives after retransmitted */
+	for (n = 0; l->loss > 0 && n < len; n += LO_MSS) {
+		if (rand_r(&r->seed) < l->loss * RAND_MAX) {
+			due += l->delay * 2;
+			break;
+		}
+	}
+
+	/* TCP delivers data in order */
+	r->last_due = max(r->last_due, due);
+	return r->last_due;
+}
+
+static int lo_send_full(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = send(fd, buf, len, MSG_NOSIGNAL)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void *lo_relay_thread(void *arg)
+{
+	struct lo_relay *r = arg;
+	struct lo_pkt *head = NULL, *tail = NULL, *p;
+	size_t queued = 0;
+	struct pollfd pfd;
+	bool eof = false;
+	uint64_t now;
+	int timeout;
+	ssize_t n;
+
+	while (!eof || head) {
+		/* deliver data due */
+		for (now = lo_now(); head && head->due <= now; now = lo_now()) {
+			if (lo_send_full(r->out, head->data, head->len) < 0)
+				goto err_out;
+			p = head;
+			head = head->next;
+			queued -= p->len;
+			free(p);
+		}
+		if (!head)
+			tail = NULL;
+
+		/* poll() waits msec, so that data can be late by 1 msec.
+		 * the rate is kept because due is scheduled by free_at. */
+		timeout = head ? (head->due - now + 999) / 1000 : -1;
+		pfd.fd = r->in;
+		pfd.events = !eof && queued < r->l->queue ? POLLIN : 0;
+		if (poll(&pfd, 1, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			goto err_out;
+		}
+		if (!(pfd.revents & (POLLIN | POLLHUP | POLLERR)))
+			continue;
+
+		if (!(p = malloc(sizeof(*p))))
+			goto err_out;
+		if ((n = read(r->in, p->data, sizeof(p->data))) <= 0) {
+			free(p);
+			eof = true;
+			continue;
+		}
+		p->len = n;
+		p->next = NULL;
+		p->due = lo_schedule(r, n, lo_now());
+		if (tail)
+			tail->next = p;
+		else
+			head = p;
+		tail = p;
+		queued += n;
+	}
+
+	shutdown(r->out, SHUT_WR);
+	goto out;
+
+err_out:
+	/* wake the relay of the other direction */
+	shutdown(r->in, SHUT_RDWR);
+	shutdown(r->out, SHUT_RDWR);
+	while (head) {
+		p = head;
+		head = head->next;
+		free(p);
+	}
+out:
+	lo_link_put(r->l);
+	free(r);
+	return NULL;
+}
+
+static int lo_relay_start(struct lo_link *l, int in, int out, unsigned int seed)
+{
+	struct lo_relay *r;
+	pthread_t tid;
+	int ret;
+
+	if (!(r = calloc(1, sizeof(*r)))) {
+		priv_set_errv("calloc: %s", strerrno());
+		return -1;
+	}
+	r->l = l;
+	r->in = in;
+	r->out = out;
+	r->seed = seed;
+
+	__sync_add_and_fetch(&l->refcnt, 1);
+	if ((ret = pthread_create(&tid, NULL, lo_relay_thread, r)) != 0) {
+		priv_set_errv("pthread_create: %s", strerror(ret));
+		__sync_sub_and_fetch(&l->refcnt, 1);
+		free(r);
+		return -1;
+	}
+	pthread_detach(tid);
+	return 0;
+}
+
+
+/* sftp server */
+
+struct lo_handle {
+	int	fd;
+	DIR	*dir;
+	char	*path;
+};
+
+struct lo_server {
+	int		fd;
+	sftp_session	sftp;
+	char		*buf;	/* for read requests */
+	size_t		buf_sz;
+};
+
+static int lo_reply_errno(sftp_client_message msg, int err)
+{
+	uint32_t status;
+
+	switch (err) {
+	case 0:
+		status = SSH_FX_OK;
+		break;
+	case ENOENT:
+		status = SSH_FX_NO_SUCH_FILE;
+		break;
+	case EACCES:
+	case EPERM:
+		status = SSH_FX_PERMISSION_DENIED;
+		break;
+	default:
+		status = SSH_FX_FAILURE;
+	}
+	return sftp_reply_status(msg, status, err ? strerror(err) : NULL);
+}
+
+static void lo_stat_to_attr(struct stat *st, struct sftp_attributes_struct *a)
+{
+	memset(a, 0, sizeof(*a));
+	a->flags = (SSH_FILEXFER_ATTR_SIZE | SSH_FILEXFER_ATTR_UIDGID |
+		    SSH_FILEXFER_ATTR_PERMISSIONS | SSH_FILEXFER_ATTR_ACMODTIME);
+	a->size = st->st_size;
+	a->uid = st->st_uid;
+	a->gid = st->st_gid;
+	a->permissions = st->st_mode;
+	a->atime = st->st_atime;
+	a->mtime = st->st_mtime;
+}
+
+static int lo_setstat(const char *path, int fd, sftp_attributes a)
+{
+	struct timeval tv[2];
+
+	if (a->flags & SSH_FILEXFER_ATTR_SIZE &&
+	    (fd >= 0 ? ftruncate(fd, a->size) : truncate(path, a->size)) < 0)
+		return -1;
+	if (a->flags & SSH_FILEXFER_ATTR_PERMISSIONS &&
+	    (fd >= 0 ? fchmod(fd, a->permissions & 07777) :
+	     chmod(path, a->permissions & 07777)) < 0)
+		return -1;
+	if (a->flags & SSH_FILEXFER_ATTR_ACMODTIME) {
+		tv[0].tv_sec = a->atime;
+		tv[0].tv_usec = a->atime_nseconds / 1000;
+		tv[1].tv_sec = a->mtime;
+		tv[1].tv_usec = a->mtime_nseconds / 1000;
+		if ((fd >= 0 ? futimes(fd, tv) : utimes(path, tv)) < 0)
+			return -1;
+	}
+	return 0; /* uid and gid are ignored */
+}
+
+static int lo_reply_handle(struct lo_server *s, sftp_client_message msg, int fd, DIR *dir)
+{
+	struct lo_handle *h;
+	ssh_string handle;
+	int ret;
+
+	if (!(h = calloc(1, sizeof(*h))) || !(h->path = strdup(msg->filename))) {
+		free(h);
+		goto err_out;
+	}
+	h->fd = fd;
+	h->dir = dir;
+	if (!(handle = sftp_handle_alloc(s->sftp, h))) {
+		free(h->path);
+		free(h);
+		errno = EMFILE;
+		goto err_out;
+	}
+	ret = sftp_reply_handle(msg, handle);
+	ssh_string_free(handle);
+	return ret;
+
+err_out:
+	ret = lo_reply_errno(msg, errno);
+	if (fd >= 0)
+		close(fd);
+	if (dir)
+		closedir(dir);
+	return ret;
+}
+
+static int lo_open(struct lo_server *s, sftp_client_message msg)
+{
+	int flags = 0, fd;
+	mode_t mode = 0644;
+
+	if ((msg->flags & SSH_FXF_READ) && (msg->flags & SSH_FXF_WRITE))
+		flags = O_RDWR;
+	else if (msg->flags & SSH_FXF_WRITE)
+		flags = O_WRONLY;
+	else
+		flags = O_RDONLY;
+	if (msg->flags & SSH_FXF_APPEND)
+		flags |= O_APPEND;
+	if (msg->flags & SSH_FXF_CREAT)
+		flags |= O_CREAT;
+	if (msg->flags & SSH_FXF_TRUNC)
+		flags |= O_TRUNC;
+	if (msg->flags & SSH_FXF_EXCL)
+		flags |= O_EXCL;
+	if (msg->attr && msg->attr->flags & SSH_FILEXFER_ATTR_PERMISSIONS)
+		mode = msg->attr->permissions & 07777;
+
+	if ((fd = open(msg->filename, flags, mode)) < 0)
+		return lo_reply_errno(msg, errno);
+	return lo_reply_handle(s, msg, fd, NULL);
+}
+
+static int lo_read(struct lo_server *s, sftp_client_message msg, struct lo_handle *h)
+{
+	ssize_t n;
+	char *p;
+
+	if (msg->len > s->buf_sz) {
+		if (!(p = realloc(s->buf, msg->len)))
+			return lo_reply_errno(msg, ENOMEM);
+		s->buf = p;
+		s->buf_sz = msg->len;
+	}
+
+	if ((n = pread(h->fd, s->buf, msg->len, msg->offset)) < 0)
+		return lo_reply_errno(msg, errno);
+	if (n == 0)
+		return sftp_reply_status(msg, SSH_FX_EOF, NULL);
+	return sftp_reply_data(msg, s->buf, n);
+}
+
+static int lo_write(sftp_client_message msg, struct lo_handle *h)
+{
+	const char *data = ssh_string_data(msg->data);
+	size_t len = ssh_string_len(msg->data), done;
+	ssize_t n;
+
+	for (done = 0; done < len; done += n) {
+		n = pwrite(h->fd, data + done, len - done, msg->offset + done);
+		if (n < 0)
+			return lo_reply_errno(msg, errno);
+	}
+	return lo_reply_errno(msg, 0);
+}
+
+static int lo_readdir(sftp_client_message msg, struct lo_handle *h)
+{
+	struct sftp_attributes_struct attr;
+	char path[PATH_MAX];
+	struct dirent *e;
+	struct stat st;
+	int n;
+
+	for (n = 0; n < LO_READDIR_NR && (e = readdir(h->dir)); n++) {
+		snprintf(path, sizeof(path), "%s/%s", h->path, e->d_name);
+		if (lstat(path, &st) < 0)
+			memset(&st, 0, sizeof(st));
+		lo_stat_to_attr(&st, &attr);
+		sftp_reply_names_add(msg, e->d_name, e->d_name, &attr);
+	}
+	if (n == 0)
+		return sftp_reply_status(msg, SSH_FX_EOF, NULL);
+	return sftp_reply_names(msg);
+}
+
+static int lo_close(struct lo_server *s, sftp_client_message msg, struct lo_handle *h)
+{
+	int ret = 0;
+
+	if (h->fd >= 0)
+		ret = close(h->fd);
+	if (h->dir)
+		ret = closedir(h->dir);
+	sftp_handle_remove(s->sftp, h);
+	free(h->path);
+	free(h);
+	return lo_reply_errno(msg, ret < 0 ? errno : 0);
+}
+
+static int lo_process(struct lo_server *s, sftp_client_message msg)
+{
+	struct sftp_attributes_struct attr;
+	struct lo_handle *h = NULL;
+	char path[PATH_MAX];
+	struct stat st;
+	mode_t mode;
+	DIR *dir;
+	int ret;
+
+	switch (msg->type) {
+	case SSH_FXP_CLOSE:
+	case SSH_FXP_READ:
+	case SSH_FXP_WRITE:
+	case SSH_FXP_FSTAT:
+	case SSH_FXP_FSETSTAT:
+	case SSH_FXP_READDIR:
+		if (!(h = sftp_handle(s->sftp, msg->handle)))
+			return sftp_reply_status(msg, SSH_FX_FAILURE, "invalid handle");
+	}
+
+	switch (msg->type) {
+	case SSH_FXP_OPEN:
+		return lo_open(s, msg);
+	case SSH_FXP_CLOSE:
+		return lo_close(s, msg, h);
+	case SSH_FXP_READ:
+		return lo_read(s, msg, h);
+	case SSH_FXP_WRITE:
+		return lo_write(msg, h);
+	case SSH_FXP_STAT:
+	case SSH_FXP_LSTAT:
+	case SSH_FXP_FSTAT:
+		if (msg->type == SSH_FXP_STAT)
+			ret = stat(msg->filename, &st);
+		else if (msg->type == SSH_FXP_LSTAT)
+			ret = lstat(msg->filename, &st);
+		else
+			ret = fstat(h->fd, &st);
+		if (ret < 0)
+			return lo_reply_errno(msg, errno);
+		lo_stat_to_attr(&st, &attr);
+		return sftp_reply_attr(msg, &attr);
+	case SSH_FXP_SETSTAT:
+	case SSH_FXP_FSETSTAT:
+		ret = lo_setstat(msg->filename, h ? h->fd : -1, msg->attr);
+		return lo_reply_errno(msg, ret < 0 ? errno : 0);
+	case SSH_FXP_OPENDIR:
+		if (!(dir = opendir(msg->filename)))
+			return lo_reply_errno(msg, errno);
+		return lo_reply_handle(s, msg, -1, dir);
+	case SSH_FXP_READDIR:
+		return lo_readdir(msg, h);
+	case SSH_FXP_MKDIR:
+		mode = 0777;
+		if (msg->attr && msg->attr->flags & SSH_FILEXFER_ATTR_PERMISSIONS)
+			mode = msg->attr->permissions & 07777;
+		return lo_reply_errno(msg, mkdir(msg->filename, mode) < 0 ? errno : 0);
+	case SSH_FXP_RMDIR:
+		return lo_reply_errno(msg, rmdir(msg->filename) < 0 ? errno : 0);
+	case SSH_FXP_REMOVE:
+		return lo_reply_errno(msg, unlink(msg->filename) < 0 ? errno : 0);
+	case SSH_FXP_RENAME:
+		ret = rename(msg->filename, sftp_client_message_get_data(msg));
+		return lo_reply_errno(msg, ret < 0 ? errno : 0);
+	case SSH_FXP_REALPATH:
+		if (!realpath(msg->filename[0] ? msg->filename : ".", path))
+			return lo_reply_errno(msg, errno);
+		memset(&attr, 0, sizeof(attr));
+		return sftp_reply_name(msg, path, &attr);
+	default:
+		return sftp_reply_status(msg, SSH_FX_OP_UNSUPPORTED, "unsupported");
+	}
+}
+
+/* accept any user and the sftp subsystem */
+static ssh_channel lo_accept(ssh_session ssh)
+{
+	ssh_channel chan = NULL;
+	ssh_message msg;
+
+	while ((msg = ssh_message_get(ssh))) {
+		switch (ssh_message_type(msg)) {
+		case SSH_REQUEST_AUTH:
+			ssh_message_auth_reply_success(msg, 0);
+			break;
+		case SSH_REQUEST_CHANNEL_OPEN:
+			if (!chan && ssh_message_subtype(msg) == SSH_CHANNEL_SESSION)
+				chan = ssh_message_channel_request_open_reply_accept(msg);
+			else
+				ssh_message_reply_default(msg);
+			break;
+		case SSH_REQUEST_CHANNEL:
+			if (chan && ssh_message_subtype(msg) == SSH_CHANNEL_REQUEST_SUBSYSTEM &&
+			    strcmp(ssh_message_channel_request_subsystem(msg), "sftp") == 0) {
+				ssh_message_channel_request_reply_success(msg);
+				ssh_message_free(msg);
+				return chan;
+			}
+			ssh_message_reply_default(msg);
+			break;
+		default:
+			ssh_message_reply_default(msg);
+		}
+		ssh_message_free(msg);
+	}
+
+	if (chan)
+		ssh_channel_free(chan);
+	return NULL;
+}
+
+static void *lo_server_thread(void *arg)
+{
+	struct lo_server *s = arg;
+	sftp_client_message msg;
+	ssh_channel chan = NULL;
+	ssh_session ssh = NULL;
+	ssh_bind bind = NULL;
+	ssh_key key = NULL;
+
+	if (!(bind = ssh_bind_new()) || !(ssh = ssh_new())) {
+		pr_warn("loopback: failed to allocate ssh session");
+		close(s->fd);
+		goto out;
+	}
+
+	/* the bind owns the key */
+	if (ssh_pki_generate(SSH_KEYTYPE_ED25519, 0, &key) != SSH_OK ||
+	    ssh_bind_options_set(bind, SSH_BIND_OPTIONS_IMPORT_KEY, key) != SSH_OK) {
+		pr_warn("loopback: failed to set host key: %s", ssh_get_error(bind));
+		ssh_key_free(key);
+		close(s->fd);
+		goto out;
+	}
+
+	if (ssh_bind_accept_fd(bind, ssh, s->fd) != SSH_OK) {
+		pr_warn("loopback: accept: %s", ssh_get_error(bind));
+		close(s->fd);
+		goto out;
+	}
+
+	if (ssh_handle_key_exchange(ssh) != SSH_OK) {
+		pr_warn("loopback: key exchange: %s", ssh_get_error(ssh));
+		goto disconnect_out;
+	}
+
+	if (!(chan = lo_accept(ssh)))
+		goto disconnect_out;
+
+	/* the sftp session owns the channel */
+	if (!(s->sftp = sftp_server_new(ssh, chan))) {
+		ssh_channel_free(chan);
+		goto disconnect_out;
+	}
+	if (sftp_server_init(s->sftp) < 0) {
+		pr_warn("loopback: sftp_server_init: %s", ssh_get_error(ssh));
+		goto disconnect_out;
+	}
+
+	/* until the client disconnects */
+	while ((msg = sftp_get_client_message(s->sftp))) {
+		lo_process(s, msg);
+		sftp_client_message_free(msg);
+	}
+
+disconnect_out:
+	if (s->sftp)
+		sftp_free(s->sftp);
+	ssh_disconnect(ssh);
+out:
+	if (ssh)
+		ssh_free(ssh);
+	if (bind)
+		ssh_bind_free(bind);
+	free(s->buf);
+	free(s);
+	return NULL;
+}
+
+int loopback_connect(ssh_session ssh, const char *spec)
+{
+	struct lo_link *l = NULL;
+	struct lo_server *s;
+	int sv[2], lv[2], ret;
+	pthread_t tid;
+
+	if (!(s = calloc(1, sizeof(*s)))) {
+		priv_set_errv("calloc: %s", strerrno());
+		return -1;
+	}
+
+	if (spec && *spec && !(l = lo_link_new(spec)))
+		goto free_out;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		priv_set_errv("socketpair: %s", strerrno());
+		goto free_out;
+	}
+	s->fd = sv[1];
+
+	if (l && (l->delay || l->rate > 0)) {
+		/* client sv[0] <-> sv[1] relay lv[0] <-> lv[1] server */
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, lv) < 0) {
+			priv_set_errv("socketpair: %s", strerrno());
+			goto close_out;
+		}
+		l->fd[0] = sv[1];
+		l->fd[1] = lv[0];
+		s->fd = lv[1];
+		l->refcnt = 1; /* put below after starting relays */
+		if (lo_relay_start(l, l->fd[0], l->fd[1], 1) < 0 ||
+		    lo_relay_start(l, l->fd[1], l->fd[0], 2) < 0) {
+			shutdown(l->fd[0], SHUT_RDWR);
+			shutdown(l->fd[1], SHUT_RDWR);
+			close(lv[1]);
+			lo_link_put(l);
+			close(sv[0]);
+			free(s);
+			return -1;
+		}
+		lo_link_put(l);
+		l = NULL;
+	}
+	free(l);
+
+	if ((ret = pthread_create(&tid, NULL, lo_server_thread, s)) != 0) {
+		priv_set_errv("pthread_create: %s", strerror(ret));
+		close(s->fd);
+		close(sv[0]);
+		free(s);
+		return -1;
+	}
+	pthread_detach(tid);
+
+	if (ssh_options_set(ssh, SSH_OPTIONS_FD, &sv[0]) != SSH_OK) {
+		priv_set_errv("failed to set socket");
+		close(sv[0]);
+		return -1;
+	}
+
+	return 0;
+
+close_out:
+	close(sv[0]);
+	close(sv[1]);
+free_out:
+	free(l);
+	free(s);
+	return -1;
+}
+
+#else /* WITH_LOOPBACK */
+
+int loopback_connect(ssh_session ssh, const char *spec)
+{
+	priv_set_errv("loopback is not supported in this build");
+	return -1;
+}
+
+#endif /* WITH_LOOPBACK */
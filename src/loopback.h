@@ -0,0 +1,26 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+#ifndef _LOOPBACK_H_
+#define _LOOPBACK_H_
+
+#include <ssh.h>
+
+/*
+ * loopback is an in-process SSH and SFTP server for benchmarks and
+ * tests without sshd. loopback_connect() creates a socketpair, serves
+ * SFTP on one end by a thread, and passes the other end to the ssh
+ * session by SSH_OPTIONS_FD. The server accesses the local file
+ * system, so that remote paths are local paths.
+ *
+ * spec emulates the link between the client and the server:
+ * "rtt=MSEC,rate=BITRATE,loss=PERCENT", each of which is optional.
+ * rate is per direction and accepts k, m, and g suffixes. A segment
+ * (1448 bytes) is lost at the probability of loss, which delays the
+ * data by an RTT for retransmission, and caps the rate at the
+ * throughput of TCP under the loss rate (Mathis et al.). Losses are
+ * pseudo-random with a fixed seed, so that runs are repeatable. An
+ * empty spec connects the socketpair directly.
+ */
+
+int loopback_connect(ssh_session ssh, const char *spec);
+
+#endif /* _LOOPBACK_H_ */
@@ -26,6 +26,7 @@
 
 // 保存用户指定的网卡名
 static const char *user_netdevs[16];
+static int user_netdev_weights[16];
 static int user_netdev_count = 0;
 
 void usage(bool print_help)
@@ -38,7 +39,13 @@ void usage(bool print_help)
 	       "            [-b buf_sz] [-L limit_bitrate]\n"
 	       "            [-l login_name] [-P port] [-F ssh_config] [-o ssh_option]\n"
 	       "            [-i identity_file] [-J destination] [-c cipher_spec] [-M hmac_spec]\n"
-	       "            [-C compress] [-g congestion]\n"
+	       "            [-C compress] [-g congestion] [--adaptive-conns]\n"
+	       "            [--max-retries N] [--stall-timeout SEC] [--device dev[:weight],...]\n"
+	       "            [--remote-addrs [dev=]addr,...]\n"
+	       "            [--limit-nic limit_bitrate] [--limit-conn limit_bitrate]\n"
+	       "            [--limit-group name] [--control socket]\n"
+	       "            [--metrics-port port] [--metrics-file path] [--trace path]\n"
+	       "            [--bench size] [--loopback link]\n"
 	       "            source ... target\n"
 	       "\n");
 
@@ -53,12 +60,29 @@ void usage(bool print_help)
 	       "    -I INTERVAL        interval between SSH connection attempts (default: 0)\n"
 	       "    -W CHECKPOINT      write states to the checkpoint if transfer fails\n"
 	       "    -R CHECKPOINT      resume transferring from the checkpoint\n"
+	       "    --max-retries N    reconnections allowed on connection failures "
+	       "(default: 16)\n"
+	       "    --stall-timeout SEC  tear down connections making no progress "
+	       "(default: 60)\n"
+	       "    --control SOCKET   unix domain socket to change -L and -n, pause,\n"
+	       "                       resume, and save checkpoints while copying\n"
+	       "    --metrics-port PORT  serve Prometheus metrics on 127.0.0.1:PORT\n"
+	       "    --metrics-file PATH  write Prometheus metrics to PATH every 5 sec\n"
+	       "    --trace PATH       write a timeline of events to PATH in Chrome trace format\n"
+	       "    --bench SIZE       copy SIZE bytes from devices, e.g., /dev/zero host:/dev/null,\n"
+	       "                       for each combination of comma-separated -n, -a, -b,\n"
+	       "                       and -c values, and print the throughput matrix\n"
+	       "    --loopback LINK    copy via the in-process sftp server emulating LINK,\n"
+	       "                       e.g., rtt=20,rate=1g,loss=0.01, instead of the host\n"
 	       "\n"
 	       "    -s MIN_CHUNK_SIZE  min chunk size (default: 16M bytes)\n"
 	       "    -S MAX_CHUNK_SIZE  max chunk size (default: filesize/nr_conn/4)\n"
 	       "    -a NR_AHEAD        number of inflight SFTP commands (default: 32)\n"
 	       "    -b BUF_SZ          buffer size for i/o and transfer\n"
 	       "    -L LIMIT_BITRATE   Limit the bitrate, n[KMG] (default: 0, no limit)\n"
+	       "    --limit-nic LIMIT_BITRATE   Limit the bitrate of each network device\n"
+	       "    --limit-conn LIMIT_BITRATE  Limit the bitrate of each connection\n"
+	       "    --limit-group NAME Share the bitrate by -L among processes in NAME\n"
 	       "\n"
 	       "    -4                 use IPv4\n"
 	       "    -6                 use IPv6\n"
@@ -78,6 +102,10 @@ void usage(bool print_help)
 	       "    -C COMPRESS        enable compression: "
 	       "yes, no, zlib, zlib@openssh.com\n"
 	       "    -g CONGESTION      specify TCP congestion control algorithm\n"
+	       "    --device DEV[:WEIGHT],...  distribute connections over network devices\n"
+	       "                       by weights (default: link speed)\n"
+	       "    --remote-addrs [DEV=]ADDR,...  addresses of the remote host, paired with\n"
+	       "                       network devices by DEV= or subnets\n"
 	       "    -p                 preserve timestamps of files\n"
 	       "    -d                 increment ssh debug output level\n"
 	       "    -N                 enable Nagle's algorithm (default disabled)\n"
@@ -287,12 +315,13 @@ void print_cli(const char *fmt, ...)
 }
 
 void print_stat(bool final);
+double calculate_timedelta(struct timeval *b, struct timeval *a);
 
 long atol_with_unit(char *value, bool i)
 {
 	/* value must be "\d+[kKmMgG]?" */
 
-	char *u = value + (strlen(optarg) - 1);
+	char *u = value + (strlen(value) - 1);
 	long k = i ? 1024 : 1000;
 	long factor = 1;
 	long v;
@@ -337,16 +366,29 @@ int to_dev_null(int fd)
 	return 0;
 }
 
-// 解析逗号分隔的网卡名
-static void parse_netdevs(const char *arg) {
+// 解析逗号分隔的网卡名，可以用 NAME:WEIGHT 指定连接数的权重
+static int parse_netdevs(const char *arg) {
     char *s = strdup(arg);
-    char *p = s, *tok;
+    char *p = s, *tok, *w, *end;
     user_netdev_count = 0;
     while ((tok = strsep(&p, ",")) && user_netdev_count < 16) {
         while (*tok && isspace(*tok)) ++tok;
-        if (*tok) user_netdevs[user_netdev_count++] = strdup(tok);
+        if (!*tok)
+            continue;
+        user_netdev_weights[user_netdev_count] = 0; /* by link speed */
+        if ((w = strchr(tok, ':'))) {
+            *w++ = '\0';
+            user_netdev_weights[user_netdev_count] = strtol(w, &end, 10);
+            if (*end != '\0' || user_netdev_weights[user_netdev_count] <= 0) {
+                pr_err("invalid weight for %s: %s", tok, w);
+                free(s);
+                return -1;
+            }
+        }
+        user_netdevs[user_netdev_count++] = strdup(tok);
     }
     free(s);
+    return 0;
 }
 
 // -p 打印所有网卡详细信息
@@ -359,6 +401,142 @@ void print_netdevs(void) {
     }
 }
 
+/* bench-related functions */
+
+#define BENCH_MAX_VALUES 16
+
+/* split a comma-separated list. NULL means the default only */
+static int bench_split(char *arg, char **v)
+{
+	char *tok, *save;
+	int nr = 0;
+
+	if (!arg) {
+		v[nr++] = NULL;
+		return nr;
+	}
+
+	for (tok = strtok_r(arg, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		if (nr == BENCH_MAX_VALUES) {
+			pr_err("too many values to sweep, max %d", BENCH_MAX_VALUES);
+			return -1;
+		}
+		v[nr++] = tok;
+	}
+	return nr;
+}
+
+/* copy once and return Gbps, or -1 on error */
+static double bench_once(struct mscp_opts *o, struct mscp_ssh_opts *s,
+			 struct target *t, int nr_t, int direction, char *remote)
+{
+	struct mscp_stats st;
+	struct timeval b, a;
+	double gbps = -1;
+	int n;
+
+	if (!(m = mscp_init(o, s))) {
+		pr_err("mscp_init: %s", priv_get_err());
+		return -1;
+	}
+	signal(SIGINT, sigint_handler);
+
+	if (mscp_set_remote(m, remote, direction) < 0 || mscp_connect(m) < 0)
+		goto out;
+	for (n = 0; n < nr_t - 1; n++) {
+		if (mscp_add_src_path(m, t[n].path) < 0)
+			goto out;
+	}
+	/* exclude scanning from the time */
+	if (mscp_set_dst_path(m, t[nr_t - 1].path) < 0 || mscp_scan(m) < 0 ||
+	    mscp_scan_join(m) < 0)
+		goto out;
+
+	gettimeofday(&b, NULL);
+	if (mscp_start(m) < 0 || mscp_join(m) < 0)
+		goto out;
+	gettimeofday(&a, NULL);
+
+	mscp_get_stats(m, &st);
+	gbps = (double)st.done * 8 / calculate_timedelta(&b, &a) / 1000000000;
+out:
+	if (gbps < 0 && !interrupted)
+		pr_err("%s", priv_get_err());
+	signal(SIGINT, SIG_DFL);
+	mscp_cleanup(m);
+	mscp_free(m);
+	m = NULL;
+	return gbps;
+}
+
+static int run_bench(struct mscp_opts *o, struct mscp_ssh_opts *s, char **argv, int argc,
+		     char *list_n, char *list_a, char *list_b, char *list_c)
+{
+	char *n[BENCH_MAX_VALUES], *a[BENCH_MAX_VALUES], *b[BENCH_MAX_VALUES];
+	char *c[BENCH_MAX_VALUES];
+	int nr_n, nr_a, nr_b, nr_c, in, ia, ib, ic, direction;
+	struct mscp_opts opts;
+	struct target *t;
+	char *remote;
+	double gbps;
+
+	if (argc < 2) {
+		usage(false);
+		return 1;
+	}
+	if ((t = validate_targets(argv, argc)) == NULL)
+		return -1;
+	if (t[0].host) {
+		direction = MSCP_DIRECTION_R2L;
+		remote = t[0].host;
+		s->login_name = s->login_name ? s->login_name : t[0].user;
+	} else {
+		direction = MSCP_DIRECTION_L2R;
+		remote = t[argc - 1].host;
+		s->login_name = s->login_name ? s->login_name : t[argc - 1].user;
+	}
+
+	if ((nr_n = bench_split(list_n, n)) < 0 || (nr_a = bench_split(list_a, a)) < 0 ||
+	    (nr_b = bench_split(list_b, b)) < 0 || (nr_c = bench_split(list_c, c)) < 0)
+		return 1;
+
+	printf("%-32s %8s %8s", "cipher", "nr_ahead", "buf_sz");
+	for (in = 0; in < nr_n; in++)
+		printf(" %8s", n[in] ? n[in] : "default");
+	printf("  (Gbps by number of connections)\n");
+
+	for (ic = 0; ic < nr_c; ic++) {
+		for (ia = 0; ia < nr_a; ia++) {
+			for (ib = 0; ib < nr_b; ib++) {
+				printf("%-32s %8s %8s", c[ic] ? c[ic] : "default",
+				       a[ia] ? a[ia] : "default", b[ib] ? b[ib] : "default");
+				fflush(stdout);
+				for (in = 0; in < nr_n; in++) {
+					/* mscp_init() fills defaults into opts */
+					opts = *o;
+					opts.nr_threads = n[in] ? atoi(n[in]) : 0;
+					opts.nr_ahead = a[ia] ? atoi(a[ia]) : 0;
+					opts.buf_sz = b[ib] ? atol_with_unit(b[ib], true) : 0;
+					s->cipher = c[ic];
+					gbps = bench_once(&opts, s, t, argc, direction, remote);
+					if (interrupted) {
+						printf("\n");
+						return 1;
+					}
+					if (gbps < 0)
+						printf(" %8s", "error");
+					else
+						printf(" %8.2f", gbps);
+					fflush(stdout);
+				}
+				printf("\n");
+			}
+		}
+	}
+
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
 	struct mscp_ssh_opts s;
@@ -369,6 +547,7 @@ int main(int argc, char **argv)
 	int direction = 0;
 	char *remote = NULL, *checkpoint_save = NULL, *checkpoint_load = NULL;
 	bool quiet = false, dryrun = false, resume = false;
+	char *bench_n = NULL, *bench_a = NULL, *bench_b = NULL, *bench_c = NULL;
 	int nr_options = 0;
 
 	memset(&s, 0, sizeof(s));
@@ -378,11 +557,25 @@ int main(int argc, char **argv)
 #define mscpopts "n:m:u:I:W:R:s:S:a:b:L:46vqDrl:P:F:o:i:J:c:M:C:g:pdNh"
     static struct option longopts[] = {
         {"device", required_argument, 0, 1000},
+        {"adaptive-conns", no_argument, 0, 1001},
+        {"max-retries", required_argument, 0, 1002},
+        {"stall-timeout", required_argument, 0, 1003},
+        {"remote-addrs", required_argument, 0, 1004},
+        {"limit-nic", required_argument, 0, 1005},
+        {"limit-conn", required_argument, 0, 1006},
+        {"limit-group", required_argument, 0, 1007},
+        {"control", required_argument, 0, 1008},
+        {"metrics-port", required_argument, 0, 1009},
+        {"metrics-file", required_argument, 0, 1010},
+        {"trace", required_argument, 0, 1011},
+        {"bench", required_argument, 0, 1012},
+        {"loopback", required_argument, 0, 1013},
         {0, 0, 0, 0}
     };
     while ((ch = getopt_long(argc, argv, mscpopts, longopts, NULL)) != -1) {
         switch (ch) {
 		case 'n':
+			bench_n = strdup(optarg);
 			o.nr_threads = atoi(optarg);
 			if (o.nr_threads < 1) {
 				pr_err("invalid number of connections: %s", optarg);
@@ -412,9 +605,11 @@ int main(int argc, char **argv)
 			o.max_chunk_sz = atol_with_unit(optarg, true);
 			break;
 		case 'a':
+			bench_a = strdup(optarg);
 			o.nr_ahead = atoi(optarg);
 			break;
 		case 'b':
+			bench_b = strdup(optarg);
 			o.buf_sz = atol_with_unit(optarg, true);
 			break;
 		case 'L':
@@ -464,6 +659,7 @@ int main(int argc, char **argv)
 			s.proxyjump = optarg;
 			break;
 		case 'c':
+			bench_c = strdup(optarg);
 			s.cipher = optarg;
 			break;
 		case 'M':
@@ -488,8 +684,69 @@ int main(int argc, char **argv)
 			usage(true);
 			return 0;
 		case 1000: // --device
-            parse_netdevs(optarg);
+            if (parse_netdevs(optarg) < 0)
+                return 1;
             break;
+		case 1001: /* --adaptive-conns */
+			o.adaptive_conns = true;
+			break;
+		case 1002: /* --max-retries */
+			o.max_retries = atoi(optarg);
+			if (o.max_retries < 0) {
+				pr_err("invalid number of retries: %s", optarg);
+				return 1;
+			}
+			if (o.max_retries == 0)
+				o.max_retries = -1; /* disable reconnecting */
+			break;
+		case 1003: /* --stall-timeout */
+			o.stall_timeout = atoi(optarg);
+			if (o.stall_timeout < 0) {
+				pr_err("invalid stall timeout: %s", optarg);
+				return 1;
+			}
+			if (o.stall_timeout == 0)
+				o.stall_timeout = -1; /* disable the watchdog */
+			break;
+		case 1004: /* --remote-addrs */
+			o.remote_addrs = optarg;
+			break;
+		case 1005: /* --limit-nic */
+			o.bitrate_per_nic = atol_with_unit(optarg, false);
+			break;
+		case 1006: /* --limit-conn */
+			o.bitrate_per_conn = atol_with_unit(optarg, false);
+			break;
+		case 1007: /* --limit-group */
+			o.bwlimit_group = optarg;
+			break;
+		case 1008: /* --control */
+			o.control_sock = optarg;
+			break;
+		case 1009: /* --metrics-port */
+			o.metrics_port = atoi(optarg);
+			if (o.metrics_port < 1 || o.metrics_port > 65535) {
+				pr_err("invalid port: %s", optarg);
+				return 1;
+			}
+			break;
+		case 1010: /* --metrics-file */
+			o.metrics_file = optarg;
+			break;
+		case 1011: /* --trace */
+			o.trace = optarg;
+			break;
+		case 1012: /* --bench */
+			o.dev_size = atol_with_unit(optarg, true);
+			if (o.dev_size == 0) {
+				pr_err("invalid bench size: %s", optarg);
+				return 1;
+			}
+			break;
+		case 1013: /* --loopback */
+			/* "none" connects without emulating the link */
+			s.loopback = optarg;
+			break;
 		default:
 			usage(false);
 			return 1;
@@ -503,11 +760,20 @@ int main(int argc, char **argv)
 	s.passphrase = getenv(ENV_SSH_AUTH_PASSPHRASE);
 
 	// 初始化网卡列表
-    if (get_netdev_list(user_netdev_count ? user_netdevs : NULL, user_netdev_count) < 0) {
+    if (get_netdev_list(user_netdev_count ? user_netdevs : NULL,
+                        user_netdev_count ? user_netdev_weights : NULL,
+                        user_netdev_count) < 0) {
         pr_err("get_netdev_list failed");
         return -1;
     }
 
+	if (o.dev_size) {
+		if (user_netdev_count > 0)
+			s.bind_dev = (char *)user_netdevs[0];
+		return run_bench(&o, &s, argv + optind, argc - optind,
+				 bench_n, bench_a, bench_b, bench_c);
+	}
+
     if ((m = mscp_init(&o, &s)) == NULL) {
 		pr_err("mscp_init: %s", priv_get_err());
 		return -1;
@@ -0,0 +1,425 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <print.h>
+#include <strerrno.h>
+#include <metrics.h>
+
+#define METRICS_NR_NETDEVS 16
+#define METRICS_TIMEOUT_MSEC 1000 /* for a client to send a request */
+
+struct metrics {
+	double start; /* time of the first rendering */
+	double last; /* time of the last rendering */
+	size_t last_done;
+
+	/* bytes of copy threads at the last rendering, by thread id */
+	size_t *last_bytes;
+	int nr_last_bytes;
+};
+
+static double now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (double)ts.tv_nsec / 1000000000;
+}
+
+struct metrics *metrics_new(void)
+{
+	struct metrics *mt;
+
+	if (!(mt = malloc(sizeof(*mt)))) {
+		priv_set_errv("malloc: %s", strerrno());
+		return NULL;
+	}
+	memset(mt, 0, sizeof(*mt));
+	mt->start = mt->last = now_sec();
+
+	return mt;
+}
+
+void metrics_free(struct metrics *mt)
+{
+	free(mt->last_bytes);
+	free(mt);
+}
+
+/* bytes of a thread since the last rendering, and remember the bytes */
+static size_t metrics_thread_delta(struct metrics *mt, struct mscp_thread_stats *ts)
+{
+	size_t *p, delta;
+	int n;
+
+	if (ts->id >= mt->nr_last_bytes) {
+		n = ts->id * 2 + 1;
+		if (!(p = realloc(mt->last_bytes, sizeof(*p) * n)))
+			return 0;
+		memset(p + mt->nr_last_bytes, 0, sizeof(*p) * (n - mt->nr_last_bytes));
+		mt->last_bytes = p;
+		mt->nr_last_bytes = n;
+	}
+
+	delta = ts->bytes - mt->last_bytes[ts->id];
+	mt->last_bytes[ts->id] = ts->bytes;
+	return delta;
+}
+
+static void metrics_header(FILE *fp, const char *name, const char *type, const char *help)
+{
+	fprintf(fp, "# HELP %s %s\n", name, help);
+	fprintf(fp, "# TYPE %s %s\n", name, type);
+}
+
+static void metrics_render_histogram(FILE *fp, size_t *hist)
+{
+	const char *name = "mscp_sftp_request_latency_seconds";
+	size_t count = 0;
+	double sum = 0;
+	int n;
+
+	/* collapse buckets into powers of 2 usec */
+	metrics_header(fp, name, "histogram", "Latency of SFTP requests.");
+	for (n = 0; n < MSCP_LAT_HIST_BUCKETS; n++) {
+		count += hist[n];
+		sum += (double)hist[n] * mscp_lat_hist_usec(n) / 1000000;
+		if ((n + 1) % 8 == 0 && n + 1 < MSCP_LAT_HIST_BUCKETS)
+			fprintf(fp, "%s_bucket{le=\"%.9g\"} %zu\n", name,
+				(double)mscp_lat_hist_usec(n + 1) / 1000000, count);
+	}
+	fprintf(fp, "%s_bucket{le=\"+Inf\"} %zu\n", name, count);
+	fprintf(fp, "%s_sum %g\n", name, sum);
+	fprintf(fp, "%s_count %zu\n", name, count);
+}
+
+#define CONN_LABELS "thread=\"%d\",netdev=\"%s\",remote=\"%s\""
+#define conn_labels(ts) (ts)->id, (ts)->netdev ? (ts)->netdev : "", \
+		(ts)->remote_addr ? (ts)->remote_addr : ""
+
+static void metrics_render_telemetry(FILE *fp, struct mscp_stats_ext *s)
+{
+	struct mscp_thread_stats *ts;
+	int n, b;
+
+	metrics_header(fp, "mscp_connection_rtt_seconds", "gauge",
+		       "Smoothed RTT of a connection.");
+	for (n = 0; n < s->nr_threads; n++) {
+		ts = &s->threads[n];
+		fprintf(fp, "mscp_connection_rtt_seconds{" CONN_LABELS "} %.9g\n",
+			conn_labels(ts), (double)ts->tm.rtt / 1000000);
+	}
+	metrics_header(fp, "mscp_connection_cwnd_segments", "gauge",
+		       "Congestion window of a connection.");
+	for (n = 0; n < s->nr_threads; n++) {
+		ts = &s->threads[n];
+		fprintf(fp, "mscp_connection_cwnd_segments{" CONN_LABELS "} %u\n",
+			conn_labels(ts), ts->tm.cwnd);
+	}
+	metrics_header(fp, "mscp_connection_retransmits_total", "counter",
+		       "Segments retransmitted by a connection.");
+	for (n = 0; n < s->nr_threads; n++) {
+		ts = &s->threads[n];
+		fprintf(fp, "mscp_connection_retransmits_total{" CONN_LABELS "} %u\n",
+			conn_labels(ts), ts->tm.retrans);
+	}
+	metrics_header(fp, "mscp_connection_delivery_rate_bytes_per_second", "gauge",
+		       "Delivery rate of a connection estimated by TCP.");
+	for (n = 0; n < s->nr_threads; n++) {
+		ts = &s->threads[n];
+		fprintf(fp, "mscp_connection_delivery_rate_bytes_per_second{" CONN_LABELS
+			"} %" PRIu64 "\n", conn_labels(ts), ts->tm.delivery_rate);
+	}
+	metrics_header(fp, "mscp_connection_cpu_ratio", "gauge",
+		       "CPU time of the thread of a connection per second.");
+	for (n = 0; n < s->nr_threads; n++) {
+		ts = &s->threads[n];
+		fprintf(fp, "mscp_connection_cpu_ratio{" CONN_LABELS ",mode=\"user\"} %.3f\n",
+			conn_labels(ts), ts->tm.cpu_user);
+		fprintf(fp, "mscp_connection_cpu_ratio{" CONN_LABELS ",mode=\"system\"} %.3f\n",
+			conn_labels(ts), ts->tm.cpu_sys);
+	}
+	metrics_header(fp, "mscp_connection_bottleneck", "gauge",
+		       "What limits a connection in the last second.");
+	for (n = 0; n < s->nr_threads; n++) {
+		ts = &s->threads[n];
+		for (b = 0; b < MSCP_BOTTLENECK_NR; b++)
+			fprintf(fp, "mscp_connection_bottleneck{" CONN_LABELS
+				",bottleneck=\"%s\"} %d\n", conn_labels(ts),
+				mscp_bottleneck_str(b), ts->tm.bottleneck == b);
+	}
+}
+
+char *metrics_render(struct metrics *mt, struct mscp *m)
+{
+	struct mscp_stats_ext s = { .version = MSCP_STATS_VERSION };
+	struct {
+		const char *name;
+		size_t bytes, delta;
+	} devs[METRICS_NR_NETDEVS];
+	size_t *delta = NULL, len, remaining;
+	double now, elapsed, avg;
+	int nr_devs = 0, n, i, running = 0;
+	char *buf;
+	FILE *fp;
+
+	/* get the number of threads, then their stats */
+	if (mscp_get_stats_ext(m, &s) < 0)
+		return NULL;
+	s.max_threads = s.nr_threads;
+	s.threads = calloc(s.max_threads + 1, sizeof(*s.threads));
+	delta = calloc(s.max_threads + 1, sizeof(*delta));
+	if (!s.threads || !delta) {
+		priv_set_errv("calloc: %s", strerrno());
+		goto free_out;
+	}
+	if (mscp_get_stats_ext(m, &s) < 0)
+		goto free_out;
+
+	if (!(fp = open_memstream(&buf, &len))) {
+		priv_set_errv("open_memstream: %s", strerrno());
+		goto free_out;
+	}
+
+	now = now_sec();
+	elapsed = now - mt->last;
+	remaining = s.total > s.done ? s.total - s.done : 0;
+	avg = s.done / (now - mt->start);
+
+	metrics_header(fp, "mscp_bytes", "gauge", "Total bytes to be transferred.");
+	fprintf(fp, "mscp_bytes %zu\n", s.total);
+	metrics_header(fp, "mscp_transferred_bytes_total", "counter", "Bytes transferred.");
+	fprintf(fp, "mscp_transferred_bytes_total %zu\n", s.done);
+	metrics_header(fp, "mscp_remaining_bytes", "gauge", "Bytes remaining.");
+	fprintf(fp, "mscp_remaining_bytes %zu\n", remaining);
+	metrics_header(fp, "mscp_throughput_bytes_per_second", "gauge",
+		       "Throughput since the last scrape.");
+	fprintf(fp, "mscp_throughput_bytes_per_second %.0f\n",
+		elapsed > 0 ? (s.done - mt->last_done) / elapsed : 0);
+	metrics_header(fp, "mscp_eta_seconds", "gauge",
+		       "Estimated seconds to finish at the average throughput.");
+	if (s.scan_done && avg > 0)
+		fprintf(fp, "mscp_eta_seconds %.0f\n", remaining / avg);
+	else
+		fprintf(fp, "mscp_eta_seconds NaN\n");
+	metrics_header(fp, "mscp_retries_total", "counter", "Reconnections.");
+	fprintf(fp, "mscp_retries_total %zu\n", s.retries);
+	metrics_header(fp, "mscp_stalls_total", "counter", "Stalled connections torn down.");
+	fprintf(fp, "mscp_stalls_total %zu\n", s.stalls);
+	metrics_header(fp, "mscp_scan_done", "gauge", "Scanning source files finished.");
+	fprintf(fp, "mscp_scan_done %d\n", s.scan_done);
+	metrics_header(fp, "mscp_files", "gauge", "Files found by scan.");
+	fprintf(fp, "mscp_files %zu\n", s.files_total);
+	metrics_header(fp, "mscp_files_done", "gauge", "Files transferred.");
+	fprintf(fp, "mscp_files_done %zu\n", s.files_done);
+	metrics_header(fp, "mscp_files_inflight", "gauge", "Files being transferred.");
+	fprintf(fp, "mscp_files_inflight %zu\n", s.files_inflight);
+
+	/* per connection */
+	metrics_header(fp, "mscp_connection_transferred_bytes_total", "counter",
+		       "Bytes transferred by a connection.");
+	for (n = 0; n < s.nr_threads; n++) {
+		struct mscp_thread_stats *ts = &s.threads[n];
+		delta[n] = metrics_thread_delta(mt, ts);
+		if (ts->state == MSCP_THREAD_STATE_RUNNING)
+			running++;
+		fprintf(fp, "mscp_connection_transferred_bytes_total"
+			"{thread=\"%d\",netdev=\"%s\",remote=\"%s\"} %zu\n", ts->id,
+			ts->netdev ? ts->netdev : "", ts->remote_addr ? ts->remote_addr : "",
+			ts->bytes);
+	}
+	metrics_header(fp, "mscp_connection_throughput_bytes_per_second", "gauge",
+		       "Throughput of a connection since the last scrape.");
+	for (n = 0; n < s.nr_threads; n++) {
+		struct mscp_thread_stats *ts = &s.threads[n];
+		fprintf(fp, "mscp_connection_throughput_bytes_per_second"
+			"{thread=\"%d\",netdev=\"%s\",remote=\"%s\"} %.0f\n", ts->id,
+			ts->netdev ? ts->netdev : "", ts->remote_addr ? ts->remote_addr : "",
+			elapsed > 0 ? delta[n] / elapsed : 0);
+	}
+	metrics_header(fp, "mscp_connections", "gauge", "Connections copying files.");
+	fprintf(fp, "mscp_connections %d\n", running);
+	metrics_render_telemetry(fp, &s);
+
+	/* per network device */
+	for (n = 0; n < s.nr_threads; n++) {
+		if (!s.threads[n].netdev)
+			continue;
+		for (i = 0; i < nr_devs; i++) {
+			if (strcmp(devs[i].name, s.threads[n].netdev) == 0)
+				break;
+		}
+		if (i == nr_devs) {
+			if (nr_devs == METRICS_NR_NETDEVS)
+				continue;
+			devs[i].name = s.threads[n].netdev;
+			devs[i].bytes = devs[i].delta = 0;
+			nr_devs++;
+		}
+		devs[i].bytes += s.threads[n].bytes;
+		devs[i].delta += delta[n];
+	}
+	if (nr_devs > 0) {
+		metrics_header(fp, "mscp_netdev_transferred_bytes_total", "counter",
+			       "Bytes transferred over a network device.");
+		for (i = 0; i < nr_devs; i++)
+			fprintf(fp, "mscp_netdev_transferred_bytes_total{netdev=\"%s\"} %zu\n",
+				devs[i].name, devs[i].bytes);
+		metrics_header(fp, "mscp_netdev_throughput_bytes_per_second", "gauge",
+			       "Throughput of a network device since the last scrape.");
+		for (i = 0; i < nr_devs; i++)
+			fprintf(fp, "mscp_netdev_throughput_bytes_per_second{netdev=\"%s\"} %.0f\n",
+				devs[i].name, elapsed > 0 ? devs[i].delta / elapsed : 0);
+	}
+
+	metrics_render_histogram(fp, s.lat_hist);
+
+	fclose(fp);
+	free(s.threads);
+	free(delta);
+
+	mt->last = now;
+	mt->last_done = s.done;
+	return buf;
+
+free_out:
+	free(s.threads);
+	free(delta);
+	return NULL;
+}
+
+int metrics_write_file(struct metrics *mt, struct mscp *m, const char *pathname)
+{
+	char tmp[PATH_MAX], *buf;
+	FILE *fp;
+	int ret = -1;
+
+	if (!(buf = metrics_render(mt, m)))
+		return -1;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", pathname);
+	if (!(fp = fopen(tmp, "w"))) {
+		priv_set_errv("fopen: %s: %s", tmp, strerrno());
+		goto out;
+	}
+	if (fputs(buf, fp) == EOF) {
+		priv_set_errv("fputs: %s: %s", tmp, strerrno());
+		fclose(fp);
+		goto out;
+	}
+	if (fclose(fp) == EOF) {
+		priv_set_errv("fclose: %s: %s", tmp, strerrno());
+		goto out;
+	}
+	if (rename(tmp, pathname) < 0) {
+		priv_set_errv("rename: %s: %s", pathname, strerrno());
+		goto out;
+	}
+	ret = 0;
+out:
+	free(buf);
+	return ret;
+}
+
+int metrics_open_http(int port)
+{
+	struct sockaddr_in sin;
+	int fd, v = 1;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		priv_set_errv("socket: %s", strerrno());
+		return -1;
+	}
+
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &v, sizeof(v)) < 0) {
+		priv_set_errv("setsockopt: %s", strerrno());
+		goto err_out;
+	}
+
+	if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+		priv_set_errv("bind: 127.0.0.1:%d: %s", port, strerrno());
+		goto err_out;
+	}
+
+	if (listen(fd, 4) < 0) {
+		priv_set_errv("listen: %s", strerrno());
+		goto err_out;
+	}
+
+	return fd;
+
+err_out:
+	close(fd);
+	return -1;
+}
+
+static void metrics_respond(int fd, struct metrics *mt, struct mscp *m)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	char req[1024], hdr[256], *buf;
+	size_t len = 0;
+	ssize_t ret;
+
+	/* read the request header. any request gets the metrics */
+	while (poll(&pfd, 1, METRICS_TIMEOUT_MSEC) > 0) {
+		ret = read(fd, req + len, sizeof(req) - len - 1);
+		if (ret <= 0)
+			return;
+		len += ret;
+		req[len] = '\0';
+		if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n") || len == sizeof(req) - 1)
+			break;
+	}
+
+	if (!(buf = metrics_render(mt, m))) {
+		pr_warn("metrics: %s", priv_get_err());
+		return;
+	}
+
+	snprintf(hdr, sizeof(hdr),
+		 "HTTP/1.1 200 OK\r\n"
+		 "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+		 "Content-Length: %zu\r\n"
+		 "Connection: close\r\n\r\n", strlen(buf));
+	if (write(fd, hdr, strlen(hdr)) > 0 && write(fd, buf, strlen(buf)) < 0)
+		pr_debug("metrics: write: %s", strerrno());
+	free(buf);
+}
+
+int metrics_serve_http(int fd, struct metrics *mt, struct mscp *m, int timeout_msec)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	int cfd, ret;
+
+	if ((ret = poll(&pfd, 1, timeout_msec)) <= 0) {
+		if (ret < 0 && errno != EINTR) {
+			priv_set_errv("poll: %s", strerrno());
+			return -1;
+		}
+		return 0;
+	}
+
+	if ((cfd = accept(fd, NULL, NULL)) < 0) {
+		priv_set_errv("accept: %s", strerrno());
+		return -1;
+	}
+
+	metrics_respond(cfd, mt, m);
+	close(cfd);
+
+	return 0;
+}
@@ -0,0 +1,34 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <mscp.h>
+
+/*
+ * metrics renders mscp statistics in the Prometheus text exposition
+ * format, from mscp_get_stats_ext(). Rates are calculated between two
+ * consecutive renderings.
+ */
+
+struct metrics;
+
+struct metrics *metrics_new(void);
+void metrics_free(struct metrics *mt);
+
+/* metrics_render() returns a malloc()ed string of the metrics, or NULL
+ * on error. */
+char *metrics_render(struct metrics *mt, struct mscp *m);
+
+/* metrics_write_file() writes the metrics to pathname atomically, by
+ * renaming a temporary file as node_exporter textfile collector
+ * expects. */
+int metrics_write_file(struct metrics *mt, struct mscp *m, const char *pathname);
+
+/* metrics_open_http() listens on 127.0.0.1:port and returns the fd. */
+int metrics_open_http(int port);
+
+/* metrics_serve_http() waits for a connection up to timeout_msec, and
+ * responds the metrics to a request. */
+int metrics_serve_http(int fd, struct metrics *mt, struct mscp *m, int timeout_msec);
+
+#endif /* _METRICS_H_ */
@@ -17,9 +17,12 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <ctype.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
 #include <libssh/libssh.h>
 #include <libssh/socket.h>
 
@@ -36,18 +39,47 @@
 #include <mscp.h>
 #include <bwlimit.h>
 #include <netdev.h>
+#include <control.h>
+#include <metrics.h>
+#include <trace.h>
 
 #include <openbsd-compat/openbsd-compat.h>
 
+struct mscp_raddr {
+	char *dev; /* network device paired explicitly, or NULL */
+	char *addr; /* address (or name) of the remote host */
+	struct sockaddr_storage ss; /* resolved addr to match subnets */
+	bool resolved;
+	int conns; /* number of connections to this address */
+};
+
 struct mscp_thread {
 	struct mscp *m;
 	sftp_session sftp;
+	lock sftp_lock; /* protects sftp, chunk, and stalled from the watchdog */
 
 	/* attributes used by copy threads */
-	size_t copied_bytes;
+	struct copy_stats stats; /* written only by the thread */
 	int id;
 	int cpu;
+	int numa_node;     /* numa node of the network device, or -1 */
 	int netdev_index;  /* network device index for this thread */
+	struct mscp_raddr *raddr; /* remote address connected to, or NULL */
+	size_t acct_bytes; /* copied bytes accounted to network devices */
+	struct bwlimit bw; /* per-connection limit, under the device's one */
+	bool retire; /* exit after the current chunk, set by the monitor */
+	int state;
+#define THREAD_STATE_INIT MSCP_THREAD_STATE_INIT
+#define THREAD_STATE_CONNECTING MSCP_THREAD_STATE_CONNECTING
+#define THREAD_STATE_RUNNING MSCP_THREAD_STATE_RUNNING
+#define THREAD_STATE_DONE MSCP_THREAD_STATE_DONE
+	struct chunk *chunk; /* chunk being copied, NULL if none */
+	bool stalled; /* set by the watchdog when sftp is torn down */
+
+	/* the last progress observed by the watchdog */
+	size_t wd_bytes;
+	struct chunk *wd_chunk;
+	long wd_time;
 
 	/* thread-specific values */
 	pthread_t tid;
@@ -57,6 +89,8 @@ struct mscp_thread {
 struct mscp {
 	char *remote; /* remote host (and uername) */
 	int direction; /* copy direction */
+	struct mscp_raddr *raddrs; /* addresses of the remote host */
+	int nr_raddrs; /* length of array of raddrs */
 	char dst_path[PATH_MAX];
 
 	struct mscp_opts *opts;
@@ -64,12 +98,18 @@ struct mscp {
 
 	int *cores; /* usable cpu cores by COREMASK */
 	int nr_cores; /* length of array of cores */
+	int *core_nodes; /* numa node of each core */
+	int *core_users; /* number of threads pinned to each core */
+	bool numa; /* place threads on numa nodes of their network devices */
 
 	sem_t *sem; /* semaphore for concurrent  connecting ssh sessions */
 
 	sftp_session first; /* first sftp session */
 
 	pool *src_pool, *path_pool, *chunk_pool, *thread_pool;
+	pool *requeue_pool; /* chunks handed off by stalled threads */
+	int nr_copying; /* number of threads copying chunks */
+	bool paused; /* stop dispatching chunks, set via the control socket */
 
 	size_t total_bytes; /* total_bytes to be copied */
 	bool chunk_pool_ready;
@@ -77,8 +117,22 @@ struct mscp {
 #define chunk_pool_set_ready(m, b) ((m)->chunk_pool_ready = b)
 
 	struct bwlimit bw; /* bandwidth limit mechanism */
+	struct bwlimit *group_bw; /* share of the limit among processes */
+	struct bwlimit *nic_bw; /* per network device limits under bw */
+	int nr_nic_bw; /* length of array of nic_bw */
+
+	int retries_left; /* retry budget for reconnecting copy threads */
+	size_t nr_retries; /* number of reconnection attempts */
+	size_t nr_stalls; /* number of stalled connections torn down */
 
 	struct mscp_thread scan; /* mscp_thread for mscp_scan_thread() */
+	pthread_t tid_monitor; /* mscp_monitor_thread() for adaptive_conns
+				* and the stall watchdog */
+	long acct_time; /* last time copied bytes accounted to network devices */
+	pthread_t tid_control; /* mscp_control_thread() for the control socket */
+	int control_fd; /* listening control socket */
+	pthread_t tid_metrics; /* mscp_metrics_thread() for the exporter */
+	int metrics_fd; /* listening http socket for metrics, or -1 */
 };
 
 #define DEFAULT_MIN_CHUNK_SZ (16 << 20) /* 16MB */
@@ -93,20 +147,53 @@ struct mscp {
 
 #define DEFAULT_MAX_STARTUPS 8
 
+/* copy threads reconnect on connection failures with exponential
+ * backoff, up to max_retries times in total for a transfer. */
+#define DEFAULT_MAX_RETRIES 16
+#define RETRY_BACKOFF_MSEC 1000
+#define RETRY_BACKOFF_MAX_MSEC 32000
+
+/* adaptive_conns starts with a few connections, and adds more while
+ * the aggregate throughput improves by ADAPTIVE_GAIN or more in each
+ * sampling window. nr_threads is the upper bound. */
+#define DEFAULT_ADAPTIVE_MAX_THREADS 64
+#define ADAPTIVE_INITIAL_THREADS 4
+#define ADAPTIVE_SAMPLE_MSEC 2000
+#define ADAPTIVE_GAIN 0.1
+
+/* the watchdog in the monitor thread tears down connections of copy
+ * threads that make no progress for stall_timeout seconds, and hands
+ * their chunks off to other threads. */
+#define DEFAULT_STALL_TIMEOUT 60
+#define WATCHDOG_INTERVAL_MSEC 1000
+
+/* the monitor thread also accounts copied bytes to network devices,
+ * and weights them by throughput per connection in each window. */
+#define NETDEV_SAMPLE_MSEC 2000
+
+/* the control thread checks copy threads finished in this interval */
+#define CONTROL_POLL_MSEC 200
+
+/* the metrics thread writes the metrics file in this interval */
+#define METRICS_FILE_INTERVAL_MSEC 5000
+
 #define non_null_string(s) (s[0] != '\0')
 
 static int expand_coremask(const char *coremask, int **cores, int *nr_cores)
 {
-	int n, *core_list, core_list_len = 0, nr_usable, nr_all;
-	char c[2] = { 'x', '\0' };
+	int n, *core_list, nr_usable, nr_all, bit, v;
 	const char *_coremask;
-	long v, needle;
-	int ncores = nr_cpus();
+	long ncores = sysconf(_SC_NPROCESSORS_CONF);
 
 	/*
          * This function returns array of usable cores in `cores` and
          * returns the number of usable cores (array length) through
          * nr_cores.
+         *
+         * Each hex digit is parsed alone, so that coremask can be
+         * longer than 64 bits. Bits are limited by the number of
+         * configured cores, not by the number of cores usable for the
+         * process, because core ids of the latter can be sparse.
          */
 
 	if (strncmp(coremask, "0x", 2) == 0)
@@ -114,40 +201,36 @@ static int expand_coremask(const char *coremask, int **cores, int *nr_cores)
 	else
 		_coremask = coremask;
 
-	core_list = realloc(NULL, sizeof(int) * 64);
-	if (!core_list) {
-		priv_set_errv("realloc: %s", strerrno());
-		return -1;
-	}
-
+	core_list = NULL;
 	nr_usable = 0;
 	nr_all = 0;
 	for (n = strlen(_coremask) - 1; n >= 0; n--) {
-		c[0] = _coremask[n];
-		v = strtol(c, NULL, 16);
-		if (v == LONG_MIN || v == LONG_MAX) {
+		if (!isxdigit(_coremask[n])) {
 			priv_set_errv("invalid coremask: %s", coremask);
+			free(core_list);
 			return -1;
 		}
+		v = isdigit(_coremask[n]) ? _coremask[n] - '0' :
+					    tolower(_coremask[n]) - 'a' + 10;
 
-		for (needle = 0x01; needle < 0x10; needle <<= 1) {
-			nr_all++;
-			if (nr_all > ncores)
+		for (bit = 0; bit < 4; bit++, nr_all++) {
+			if (nr_all >= ncores)
 				break; /* too long coremask */
-			if (v & needle) {
-				nr_usable++;
-				core_list = realloc(core_list, sizeof(int) * nr_usable);
-				if (!core_list) {
-					priv_set_errv("realloc: %s", strerrno());
-					return -1;
-				}
-				core_list[nr_usable - 1] = nr_all - 1;
+			if (!(v & (1 << bit)))
+				continue;
+			nr_usable++;
+			core_list = realloc(core_list, sizeof(int) * nr_usable);
+			if (!core_list) {
+				priv_set_errv("realloc: %s", strerrno());
+				return -1;
 			}
+			core_list[nr_usable - 1] = nr_all;
 		}
 	}
 
 	if (nr_usable < 1) {
 		priv_set_errv("invalid core mask: %s", coremask);
+		free(core_list);
 		return -1;
 	}
 
@@ -156,6 +239,94 @@ static int expand_coremask(const char *coremask, int **cores, int *nr_cores)
 	return 0;
 }
 
+static int parse_remote_addrs(const char *remote_addrs, int ai_family,
+			      struct mscp_raddr **raddrs, int *nr_raddrs)
+{
+	struct addrinfo hints, *res;
+	struct mscp_raddr *r, *new;
+	char *s, *p, *tok, *eq, *addr;
+	size_t len;
+
+	/* remote_addrs is ADDR[,ADDR...] or DEV=ADDR[,DEV=ADDR...]. An
+	 * IPv6 address can be enclosed by []. */
+
+	if (!(s = strdup(remote_addrs))) {
+		priv_set_errv("strdup: %s", strerrno());
+		return -1;
+	}
+
+	p = s;
+	while ((tok = strsep(&p, ","))) {
+		if (!*tok)
+			continue;
+
+		if (!(new = realloc(*raddrs, sizeof(*new) * (*nr_raddrs + 1)))) {
+			priv_set_errv("realloc: %s", strerrno());
+			goto err_out;
+		}
+		*raddrs = new;
+		r = &new[(*nr_raddrs)++];
+		memset(r, 0, sizeof(*r));
+
+		addr = tok;
+		if ((eq = strchr(tok, '='))) {
+			*eq = '\0';
+			addr = eq + 1;
+			if (!(r->dev = strdup(tok))) {
+				priv_set_errv("strdup: %s", strerrno());
+				goto err_out;
+			}
+		}
+		len = strlen(addr);
+		if (len > 2 && addr[0] == '[' && addr[len - 1] == ']') {
+			addr[len - 1] = '\0';
+			addr++;
+		}
+		if (!*addr) {
+			priv_set_errv("invalid remote address: %s", remote_addrs);
+			goto err_out;
+		}
+		if (!(r->addr = strdup(addr))) {
+			priv_set_errv("strdup: %s", strerrno());
+			goto err_out;
+		}
+
+		/* resolve it here only for matching subnets. names are
+		 * resolved again on connecting. */
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = ai_family ? ai_family : AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		if (getaddrinfo(r->addr, NULL, &hints, &res) == 0) {
+			memcpy(&r->ss, res->ai_addr, res->ai_addrlen);
+			r->resolved = true;
+			freeaddrinfo(res);
+		}
+
+		pr_notice("remote address: %s%s%s", r->dev ? r->dev : "", r->dev ? "=" : "",
+			  r->addr);
+	}
+
+	free(s);
+	return 0;
+
+err_out:
+	free(s);
+	return -1;
+}
+
+static void free_remote_addrs(struct mscp_raddr *raddrs, int nr_raddrs)
+{
+	int n;
+
+	for (n = 0; n < nr_raddrs; n++) {
+		if (raddrs[n].dev)
+			free(raddrs[n].dev);
+		if (raddrs[n].addr)
+			free(raddrs[n].addr);
+	}
+	free(raddrs);
+}
+
 static int default_nr_threads()
 {
 	return (int)(floor(log(nr_cpus()) * 2) + 1);
@@ -167,7 +338,8 @@ static int validate_and_set_defaut_params(struct mscp_opts *o)
 		priv_set_errv("invalid nr_threads: %d", o->nr_threads);
 		return -1;
 	} else if (o->nr_threads == 0)
-		o->nr_threads = default_nr_threads();
+		o->nr_threads = o->adaptive_conns ? DEFAULT_ADAPTIVE_MAX_THREADS :
+						    default_nr_threads();
 
 	if (o->nr_ahead < 0) {
 		priv_set_errv("invalid nr_ahead: %d", o->nr_ahead);
@@ -206,6 +378,20 @@ static int validate_and_set_defaut_params(struct mscp_opts *o)
 		o->max_startups = 1;
 	}
 
+	if (o->max_retries == 0)
+		o->max_retries = DEFAULT_MAX_RETRIES;
+	else if (o->max_retries < -1) {
+		priv_set_errv("invalid max_retries: %d", o->max_retries);
+		return -1;
+	}
+
+	if (o->stall_timeout == 0)
+		o->stall_timeout = DEFAULT_STALL_TIMEOUT;
+	else if (o->stall_timeout < -1) {
+		priv_set_errv("invalid stall_timeout: %d", o->stall_timeout);
+		return -1;
+	}
+
 	return 0;
 }
 
@@ -241,6 +427,10 @@ struct mscp *mscp_init(struct mscp_opts *o, struct mscp_ssh_opts *s)
 		return NULL;
 	}
 
+	if (o->trace && trace_start(o->trace) < 0)
+		return NULL;
+	trace_thread_name("main", 0);
+
 	if (!(m = malloc(sizeof(*m)))) {
 		priv_set_errv("malloc: %s", strerrno());
 		return NULL;
@@ -248,6 +438,7 @@ struct mscp *mscp_init(struct mscp_opts *o, struct mscp_ssh_opts *s)
 	memset(m, 0, sizeof(*m));
 	m->opts = o;
 	m->ssh_opts = s;
+	m->retries_left = o->max_retries < 0 ? 0 : o->max_retries;
 	chunk_pool_set_ready(m, false);
 
 	if (!(m->src_pool = pool_new())) {
@@ -270,6 +461,11 @@ struct mscp *mscp_init(struct mscp_opts *o, struct mscp_ssh_opts *s)
 		goto free_out;
 	}
 
+	if (!(m->requeue_pool = pool_new())) {
+		priv_set_errv("pool_new: %s", strerrno());
+		goto free_out;
+	}
+
 	if ((m->sem = sem_create(o->max_startups)) == NULL) {
 		priv_set_errv("sem_create: %s", strerrno());
 		goto free_out;
@@ -286,14 +482,54 @@ struct mscp *mscp_init(struct mscp_opts *o, struct mscp_ssh_opts *s)
 			strlcat(b, c, sizeof(b));
 		}
 		pr_notice("usable cpu cores:%s", b);
+
+		m->core_nodes = calloc(m->nr_cores, sizeof(int));
+		m->core_users = calloc(m->nr_cores, sizeof(int));
+		if (!m->core_nodes || !m->core_users) {
+			priv_set_errv("calloc: %s", strerrno());
+			goto free_out;
+		}
+		for (n = 0; n < m->nr_cores; n++)
+			m->core_nodes[n] = numa_node_of_cpu(m->cores[n]);
 	}
 
-	if (bwlimit_init(&m->bw, o->bitrate, 100) < 0) { /* 100ms window (hardcoded) */
+	if ((m->numa = nr_numa_nodes() > 1))
+		pr_notice("numa nodes: %d, place threads on nodes of network devices",
+			  nr_numa_nodes());
+
+	if (o->remote_addrs &&
+	    parse_remote_addrs(o->remote_addrs, s->ai_family, &m->raddrs, &m->nr_raddrs) < 0)
+		goto free_out;
+
+	if (o->bwlimit_group) {
+		/* the bitrate limits the group, and this process takes
+		 * a share of it */
+		if (!(m->group_bw = bwlimit_group_attach(o->bwlimit_group, o->bitrate, 100)))
+			goto free_out;
+		bwlimit_init(&m->bw, 0, 100);
+		bwlimit_set_parent(&m->bw, m->group_bw);
+		pr_notice("bitrate limit group: %s", o->bwlimit_group);
+	} else if (bwlimit_init(&m->bw, o->bitrate, 100) < 0) { /* 100ms window (hardcoded) */
 		priv_set_errv("bwlimit_init: %s", strerrno());
 		goto free_out;
 	}
 	pr_notice("bitrate limit: %lu bps", o->bitrate);
 
+	if (o->bitrate_per_nic && get_netdev_count() > 0) {
+		m->nr_nic_bw = get_netdev_count();
+		if (!(m->nic_bw = aligned_alloc(64, sizeof(*m->nic_bw) * m->nr_nic_bw))) {
+			priv_set_errv("aligned_alloc: %s", strerrno());
+			goto free_out;
+		}
+		for (n = 0; n < m->nr_nic_bw; n++) {
+			bwlimit_init(&m->nic_bw[n], o->bitrate_per_nic, 100);
+			bwlimit_set_parent(&m->nic_bw[n], &m->bw);
+		}
+		pr_notice("bitrate limit per network device: %lu bps", o->bitrate_per_nic);
+	}
+	if (o->bitrate_per_conn)
+		pr_notice("bitrate limit per connection: %lu bps", o->bitrate_per_conn);
+
 	return m;
 
 free_out:
@@ -305,8 +541,22 @@ free_out:
 		pool_free(m->chunk_pool);
 	if (m->thread_pool)
 		pool_free(m->thread_pool);
+	if (m->requeue_pool)
+		pool_free(m->requeue_pool);
 	if (m->remote)
 		free(m->remote);
+	if (m->cores)
+		free(m->cores);
+	if (m->core_nodes)
+		free(m->core_nodes);
+	if (m->core_users)
+		free(m->core_users);
+	if (m->raddrs)
+		free_remote_addrs(m->raddrs, m->nr_raddrs);
+	if (m->nic_bw)
+		free(m->nic_bw);
+	if (m->group_bw)
+		bwlimit_group_detach(m->group_bw);
 	free(m);
 	return NULL;
 }
@@ -373,9 +623,25 @@ static void mscp_stop_scan_thread(struct mscp *m)
 		pthread_cancel(m->scan.tid);
 }
 
+static void mscp_stop_monitor_thread(struct mscp *m)
+{
+	if (m->tid_monitor)
+		pthread_cancel(m->tid_monitor);
+}
+
+static void mscp_stop_control_thread(struct mscp *m)
+{
+	if (m->tid_control)
+		pthread_cancel(m->tid_control);
+	if (m->tid_metrics)
+		pthread_cancel(m->tid_metrics);
+}
+
 void mscp_stop(struct mscp *m)
 {
 	mscp_stop_scan_thread(m);
+	mscp_stop_monitor_thread(m);
+	mscp_stop_control_thread(m);
 	mscp_stop_copy_thread(m);
 }
 
@@ -391,6 +657,8 @@ void *mscp_scan_thread(void *arg)
 	glob_t pglob;
 	int n;
 
+	trace_thread_name("scan", 0);
+
 	switch (m->direction) {
 	case MSCP_DIRECTION_L2R:
 		src_sftp = NULL;
@@ -423,6 +691,7 @@ void *mscp_scan_thread(void *arg)
 	a.min_chunk_sz = m->opts->min_chunk_sz;
 	a.max_chunk_sz = m->opts->max_chunk_sz;
 	a.chunk_align = get_page_mask();
+	a.dev_size = m->opts->dev_size;
 
 	pr_info("start to walk source path(s)");
 
@@ -527,37 +796,91 @@ int mscp_checkpoint_load(struct mscp *m, const char *pathname)
 
 int mscp_checkpoint_save(struct mscp *m, const char *pathname)
 {
-	return checkpoint_save(pathname, m->direction, m->ssh_opts->login_name, m->remote,
-			       m->path_pool, m->chunk_pool);
+	int ret;
+
+	/* it can be saved while copying, via the control socket */
+	pool_lock(m->path_pool);
+	pool_lock(m->chunk_pool);
+	ret = checkpoint_save(pathname, m->direction, m->ssh_opts->login_name, m->remote,
+			      m->path_pool, m->chunk_pool);
+	pool_unlock(m->chunk_pool);
+	pool_unlock(m->path_pool);
+
+	return ret;
 }
 
 static void *mscp_copy_thread(void *arg);
 
+/* the bucket limiting connections over the network device, under
+ * the global one. */
+static struct bwlimit *mscp_netdev_bwlimit(struct mscp *m, int netdev_index)
+{
+	if (netdev_index < 0 || netdev_index >= m->nr_nic_bw)
+		return &m->bw;
+	return &m->nic_bw[netdev_index];
+}
+
+static int mscp_netdev_numa_node(struct mscp *m, int netdev_index)
+{
+	struct netdev *dev;
+
+	if (!m->numa || !(dev = get_netdev_by_position(netdev_index)))
+		return -1;
+	return dev->numa_node;
+}
+
+static int mscp_pick_core(struct mscp *m, int numa_node)
+{
+	int n, best = -1;
+	bool local, best_local = false;
+
+	/* pick the least used core in COREMASK, preferring ones on the
+	 * numa node. Without numa nodes, this is round-robin. Called
+	 * only by the thread spawning copy threads. */
+	for (n = 0; n < m->nr_cores; n++) {
+		local = numa_node > -1 && m->core_nodes[n] == numa_node;
+		if (best < 0 || (local && !best_local) ||
+		    (local == best_local && m->core_users[n] < m->core_users[best])) {
+			best = n;
+			best_local = local;
+		}
+	}
+
+	m->core_users[best]++;
+	return m->cores[best];
+}
+
 static struct mscp_thread *mscp_copy_thread_spawn(struct mscp *m, int id)
 {
 	struct mscp_thread *t;
 	int ret;
 	const char *netdev;
 
-	if (!(t = malloc(sizeof(*t)))) {
-		priv_set_errv("malloc: %s", strerrno());
+	/* aligned for bwlimit */
+	if (!(t = aligned_alloc(64, sizeof(*t)))) {
+		priv_set_errv("aligned_alloc: %s", strerrno());
 		return NULL;
 	}
 
 	memset(t, 0, sizeof(*t));
 	t->m = m;
 	t->id = id;
-	if (m->cores == NULL)
-		t->cpu = -1; /* not pinned to cpu */
-	else
-		t->cpu = m->cores[id % m->nr_cores];
+	lock_init(&t->sftp_lock);
+	bwlimit_init(&t->bw, m->opts->bitrate_per_conn, 100);
 
-	/* Assign network device to thread */
-	t->netdev_index = id % get_netdev_count();
+	/* Assign network device to thread by weighted round-robin */
+	t->netdev_index = netdev_next_index();
 	netdev = get_netdev_by_index(t->netdev_index);
 	if (netdev) {
 		pr_notice("thread[%d]: using network device %s", t->id, netdev);
 	}
+	bwlimit_set_parent(&t->bw, mscp_netdev_bwlimit(m, t->netdev_index));
+
+	t->numa_node = mscp_netdev_numa_node(m, t->netdev_index);
+	if (m->cores == NULL)
+		t->cpu = -1; /* not pinned to cpu */
+	else
+		t->cpu = mscp_pick_core(m, t->numa_node);
 
 	if ((ret = pthread_create(&t->tid, NULL, mscp_copy_thread, t)) < 0) {
 		priv_set_errv("pthread_create: %d", ret);
@@ -568,18 +891,13 @@ static struct mscp_thread *mscp_copy_thread_spawn(struct mscp *m, int id)
 	return t;
 }
 
-int mscp_start(struct mscp *m)
+static int mscp_spawn_copy_threads(struct mscp *m, int nr)
 {
 	struct mscp_thread *t;
-	int n, ret = 0;
-
-	if ((n = pool_size(m->chunk_pool)) < m->opts->nr_threads) {
-		pr_notice("we have %d chunk(s), set number of connections to %d", n, n);
-		m->opts->nr_threads = n;
-	}
+	int n;
 
-	for (n = 0; n < m->opts->nr_threads; n++) {
-		t = mscp_copy_thread_spawn(m, n);
+	for (n = 0; n < nr; n++) {
+		t = mscp_copy_thread_spawn(m, pool_size(m->thread_pool));
 		if (!t)
 			break;
 		if (pool_push_lock(m->thread_pool, t) < 0) {
@@ -591,24 +909,155 @@ int mscp_start(struct mscp *m)
 	return n;
 }
 
+static void *mscp_monitor_thread(void *arg);
+static void *mscp_control_thread(void *arg);
+static void *mscp_metrics_thread(void *arg);
+static void mscp_account_netdevs(struct mscp *m, size_t *bytes, int *conns);
+
+int mscp_start(struct mscp *m)
+{
+	int n, nr, ret;
+
+	if ((n = pool_size(m->chunk_pool)) < m->opts->nr_threads) {
+		pr_notice("we have %d chunk(s), set number of connections to %d", n, n);
+		m->opts->nr_threads = n;
+	}
+
+	netdev_print_plan(m->opts->nr_threads);
+
+	if (m->opts->adaptive_conns)
+		nr = min(ADAPTIVE_INITIAL_THREADS, m->opts->nr_threads);
+	else
+		nr = m->opts->nr_threads;
+
+	if (m->opts->control_sock) {
+		if ((m->control_fd = control_open(m->opts->control_sock)) < 0)
+			return -1;
+		pr_notice("control socket: %s", m->opts->control_sock);
+	}
+
+	m->metrics_fd = -1;
+	if (m->opts->metrics_port > 0) {
+		if ((m->metrics_fd = metrics_open_http(m->opts->metrics_port)) < 0) {
+			n = -1;
+			goto close_out;
+		}
+		pr_notice("metrics: http://127.0.0.1:%d/metrics", m->opts->metrics_port);
+	}
+
+	if ((n = mscp_spawn_copy_threads(m, nr)) < nr)
+		goto close_out;
+
+	if (m->opts->control_sock) {
+		if ((ret = pthread_create(&m->tid_control, NULL, mscp_control_thread, m)) < 0) {
+			priv_set_errv("pthread_create: %d", ret);
+			control_close(m->control_fd, m->opts->control_sock);
+			m->tid_control = 0;
+		}
+	}
+
+	if (m->metrics_fd >= 0 || m->opts->metrics_file) {
+		if ((ret = pthread_create(&m->tid_metrics, NULL, mscp_metrics_thread, m)) < 0) {
+			priv_set_errv("pthread_create: %d", ret);
+			if (m->metrics_fd >= 0)
+				close(m->metrics_fd);
+			m->tid_metrics = 0;
+		}
+	}
+
+	if (!m->opts->adaptive_conns && m->opts->stall_timeout < 0)
+		return n; /* no need to monitor copy threads */
+
+	if ((ret = pthread_create(&m->tid_monitor, NULL, mscp_monitor_thread, m)) < 0) {
+		priv_set_errv("pthread_create: %d", ret);
+		m->tid_monitor = 0;
+	}
+
+	return n;
+
+close_out:
+	if (m->opts->control_sock)
+		control_close(m->control_fd, m->opts->control_sock);
+	if (m->metrics_fd >= 0)
+		close(m->metrics_fd);
+	return n;
+}
+
+/* lower bound of the bucket where the q-quantile of hist falls */
+static size_t mscp_lat_hist_quantile(size_t *hist, double q)
+{
+	size_t total = 0, sum = 0;
+	int n;
+
+	for (n = 0; n < MSCP_LAT_HIST_BUCKETS; n++)
+		total += hist[n];
+	for (n = 0; n < MSCP_LAT_HIST_BUCKETS; n++) {
+		sum += hist[n];
+		if (sum > 0 && sum >= total * q)
+			return mscp_lat_hist_usec(n);
+	}
+	return 0;
+}
+
+/* print how long a copy thread was bound by each bottleneck */
+static void mscp_print_telemetry(struct mscp_thread *t)
+{
+	struct mscp_conn_telemetry *r = &t->stats.tm.result;
+	struct netdev *dev = get_netdev_by_position(t->netdev_index);
+	char buf[128];
+	int n, len = 0;
+
+	for (n = 0; n < MSCP_BOTTLENECK_NR; n++) {
+		if (r->intervals[n])
+			len += snprintf(buf + len, sizeof(buf) - len, " %s %us",
+					mscp_bottleneck_str(n), r->intervals[n]);
+	}
+	if (len == 0)
+		return; /* copied in less than an interval */
+
+	pr_info("thread[%d]%s%s: rtt %u usec, cwnd %u, retrans %u, bound by:%s", t->id,
+		dev ? " on " : "", dev ? dev->name : "", r->rtt, r->cwnd, r->retrans, buf);
+}
+
 int mscp_join(struct mscp *m)
 {
+	struct mscp_stats_ext s = { .version = MSCP_STATS_VERSION };
 	struct mscp_thread *t;
+	struct chunk *c;
 	struct path *p;
 	unsigned int idx;
 	size_t total_copied_bytes = 0, nr_copied = 0, nr_tobe_copied = 0;
+	size_t nr_left_chunks = 0;
 	int n, ret = 0;
 
 	/* waiting for scan thread joins... */
 	ret = mscp_scan_join(m);
 
+	/* the monitor and the control thread may spawn copy
+	 * threads. join them before them. */
+	if (m->tid_monitor) {
+		pthread_join(m->tid_monitor, NULL);
+		m->tid_monitor = 0;
+	}
+	if (m->tid_control) {
+		pthread_join(m->tid_control, NULL);
+		control_close(m->control_fd, m->opts->control_sock);
+		m->tid_control = 0;
+	}
+	if (m->tid_metrics) {
+		pthread_join(m->tid_metrics, NULL);
+		if (m->metrics_fd >= 0)
+			close(m->metrics_fd);
+		m->tid_metrics = 0;
+	}
+
 	/* waiting for copy threads join... */
 	pool_for_each(m->thread_pool, t, idx) {
 		pthread_join(t->tid, NULL);
 	}
 
 	pool_for_each(m->thread_pool, t, idx) {
-		total_copied_bytes += t->copied_bytes;
+		total_copied_bytes += t->stats.copied_bytes;
 		if (t->ret != 0)
 			ret = t->ret;
 		if (t->sftp) {
@@ -617,6 +1066,17 @@ int mscp_join(struct mscp *m)
 		}
 	}
 
+	/* a chunk handed off by a stalled thread may be left when no
+	 * thread was alive to take it over */
+	pool_for_each(m->chunk_pool, c, idx) {
+		if (c->state != CHUNK_STATE_DONE)
+			nr_left_chunks++;
+	}
+	if (ret == 0 && nr_left_chunks > 0) {
+		pr_err("%lu chunk(s) left uncopied", nr_left_chunks);
+		ret = -1;
+	}
+
 	/* count up number of transferred files */
 	pool_iter_for_each(m->path_pool, p) {
 		nr_tobe_copied++;
@@ -632,6 +1092,25 @@ int mscp_join(struct mscp *m)
 
 	pr_notice("%lu/%lu bytes copied for %lu/%lu files", total_copied_bytes,
 		  m->total_bytes, nr_copied, nr_tobe_copied);
+	if (m->nr_retries || m->nr_stalls)
+		pr_notice("%lu reconnection(s), %lu stalled connection(s)", m->nr_retries,
+			  m->nr_stalls);
+
+	mscp_account_netdevs(m, NULL, NULL);
+	for (n = 0; get_netdev_count() > 1 && n < get_netdev_count(); n++) {
+		struct netdev *dev = get_netdev_by_position(n);
+		pr_notice("%lu bytes copied over %s", dev->bytes, dev->name);
+	}
+
+	mscp_get_stats_ext(m, &s);
+	pr_notice("sftp request latency: p50 %lu usec, p99 %lu usec, max %lu usec",
+		  mscp_lat_hist_quantile(s.lat_hist, 0.5),
+		  mscp_lat_hist_quantile(s.lat_hist, 0.99),
+		  mscp_lat_hist_quantile(s.lat_hist, 1));
+
+	pool_for_each(m->thread_pool, t, idx) {
+		mscp_print_telemetry(t);
+	}
 
 	return ret;
 }
@@ -653,47 +1132,261 @@ static void wait_for_interval(int interval)
 	next = now + interval * 1000000;
 }
 
-void *mscp_copy_thread(void *arg)
+static struct mscp_raddr *mscp_pair_remote_addr(struct mscp *m, const char *netdev)
+{
+	struct mscp_raddr *r, *best = NULL;
+	int n, pass;
+
+	/* Pair the network device with a remote address, in order of
+	 * (0) addresses paired with the device explicitly, (1)
+	 * addresses in a subnet of the device, (2) addresses not paired
+	 * with other devices, and (3) any addresses. Among them, the
+	 * address with the fewest connections is chosen. */
+	for (pass = 0; pass < 4 && !best; pass++) {
+		for (n = 0; n < m->nr_raddrs; n++) {
+			r = &m->raddrs[n];
+			if (pass == 0 && !(netdev && r->dev && strcmp(r->dev, netdev) == 0))
+				continue;
+			if (pass == 1 && !(netdev && !r->dev && r->resolved &&
+					   netdev_in_subnet(netdev, (struct sockaddr *)&r->ss)))
+				continue;
+			if (pass == 2 && r->dev)
+				continue;
+			if (!best || r->conns < best->conns)
+				best = r;
+		}
+	}
+
+	return best;
+}
+
+static void mscp_copy_thread_connect(struct mscp_thread *t)
 {
-	sftp_session src_sftp, dst_sftp;
-	struct mscp_thread *t = arg;
 	struct mscp *m = t->m;
-	struct chunk *c;
-	bool next_chunk_exist;
+	struct mscp_ssh_opts opts = *m->ssh_opts;
+	sftp_session sftp;
 	const char *netdev;
 
-	/* when error occurs, each thread prints error messages
-	 * immediately with pr_* functions. */
+	/* must be called while holding m->sem */
+
+	if (m->opts->interval > 0)
+		wait_for_interval(m->opts->interval);
+	pr_notice("thread[%d]: connecting to %s", t->id, m->remote);
+
+	// 为当前线程设置对应的网卡
+	/* threads connect concurrently, so bind_dev is set to a copy of
+	 * ssh_opts for this thread, not to the shared one */
+	netdev = get_netdev_by_index(t->netdev_index);
+	if (netdev) {
+		opts.bind_dev = (char *)netdev;
+		pr_notice("thread[%d]: using network device %s", t->id, netdev);
+	}
+
+	if (t->raddr)
+		__sync_sub_and_fetch(&t->raddr->conns, 1);
+	if ((t->raddr = mscp_pair_remote_addr(m, netdev))) {
+		__sync_add_and_fetch(&t->raddr->conns, 1);
+		opts.remote_addr = t->raddr->addr;
+		pr_notice("thread[%d]: using remote address %s", t->id, t->raddr->addr);
+	}
+
+	sftp = ssh_init_sftp_session(m->remote, &opts);
+
+	LOCK_ACQUIRE(&t->sftp_lock);
+	t->sftp = sftp;
+	LOCK_RELEASE();
+}
 
+static int mscp_copy_thread_place(struct mscp_thread *t)
+{
+	/* Pin the thread to its core, or to the cores of the numa node
+	 * of its network device. Then, buffers allocated by this thread
+	 * (and libssh for it) are preferred to be on the node. */
 	if (t->cpu > -1) {
 		if (set_thread_affinity(pthread_self(), t->cpu) < 0) {
 			pr_err("set_thread_affinity: %s", priv_get_err());
-			goto err_out;
+			return -1;
 		}
 		pr_notice("thread[%d]: pin to cpu core %d", t->id, t->cpu);
+	} else if (t->numa_node > -1) {
+		/* the node may have no cores usable for this process */
+		if (set_thread_numa_affinity(pthread_self(), t->numa_node) < 0)
+			pr_warn("thread[%d]: %s", t->id, priv_get_err());
+		else
+			pr_notice("thread[%d]: pin to numa node %d", t->id, t->numa_node);
 	}
 
+	if (t->numa_node > -1 && set_numa_mempolicy(t->numa_node) < 0)
+		pr_warn("thread[%d]: %s", t->id, priv_get_err());
+
+	return 0;
+}
+
+static void mscp_copy_thread_close(struct mscp_thread *t)
+{
+	sftp_session sftp = t->sftp;
+
+	LOCK_ACQUIRE(&t->sftp_lock);
+	t->sftp = NULL;
+	LOCK_RELEASE();
+
+	if (sftp)
+		ssh_sftp_close(sftp);
+}
+
+static int mscp_copy_thread_reconnect(struct mscp_thread *t)
+{
+	struct mscp *m = t->m;
+	long backoff = RETRY_BACKOFF_MSEC;
+	int node;
+
+	/* Re-establish the SSH connection of this thread with
+	 * exponential backoff. Each attempt consumes the retry budget
+	 * shared by all copy threads. */
+
+	t->state = THREAD_STATE_CONNECTING;
+
+	while (1) {
+		mscp_copy_thread_close(t);
+
+		if (__sync_sub_and_fetch(&m->retries_left, 1) < 0) {
+			pr_err("thread[%d]: retry budget exhausted", t->id);
+			return -1;
+		}
+		__sync_add_and_fetch(&m->nr_retries, 1);
+
+		pr_warn("thread[%d]: reconnecting in %ld msec", t->id, backoff);
+		usleep(backoff * 1000);
+		backoff = min(backoff * 2, RETRY_BACKOFF_MAX_MSEC);
+
+		/* pick the network device again, which may be steered
+		 * to another one delivering more */
+		t->netdev_index = netdev_next_index();
+		bwlimit_set_parent(&t->bw, mscp_netdev_bwlimit(m, t->netdev_index));
+		node = mscp_netdev_numa_node(m, t->netdev_index);
+		if (node != t->numa_node && t->cpu < 0) {
+			t->numa_node = node;
+			if (mscp_copy_thread_place(t) < 0)
+				return -1;
+		}
+
+		if (sem_wait(m->sem) < 0) {
+			pr_err("sem_wait: %s", strerrno());
+			return -1;
+		}
+		mscp_copy_thread_connect(t);
+		if (sem_post(m->sem) < 0) {
+			pr_err("sem_post: %s", strerrno());
+			return -1;
+		}
+
+		if (t->sftp) {
+			t->state = THREAD_STATE_RUNNING;
+			return 0;
+		}
+		pr_warn("thread[%d]: %s", t->id, priv_get_err());
+	}
+}
+
+static int mscp_copy_thread_copy_chunk(struct mscp_thread *t, struct chunk *c)
+{
+	struct mscp *m = t->m;
+	sftp_session src_sftp, dst_sftp;
+	size_t copied, off, len;
+	uint64_t start;
+	bool handoff;
+	int ret;
+
+	while (1) {
+		if (m->direction == MSCP_DIRECTION_L2R) {
+			src_sftp = NULL;
+			dst_sftp = t->sftp;
+		} else {
+			src_sftp = t->sftp;
+			dst_sftp = NULL;
+		}
+
+		copied = t->stats.copied_bytes;
+		off = c->off;
+		len = c->len;
+		start = trace_begin();
+		ret = copy_chunk(c, src_sftp, dst_sftp, m->opts->nr_ahead, m->opts->buf_sz,
+				 m->opts->preserve_ts, &t->bw, &t->stats);
+		trace_event("chunk", start, c->p->path, off, len);
+		if (ret == 0 || ssh_sftp_is_connected(t->sftp))
+			return ret; /* done, or failed not due to the connection */
+
+		/* The connection is lost. Bytes counted during the
+		 * failed attempt were acknowledged in order from
+		 * c->off, so resume the chunk from there after
+		 * reconnecting. Note that checkpoint_save() also saves
+		 * the remaining part only. */
+		if (c->state != CHUNK_STATE_COPIED) {
+			c->off += t->stats.copied_bytes - copied;
+			c->len -= t->stats.copied_bytes - copied;
+		}
+		pr_warn("thread[%d]: connection lost: %s", t->id, priv_get_err());
+
+		/* The watchdog tore down this connection. Another
+		 * connection takes over the rest of the chunk while this
+		 * thread is reconnecting. */
+		handoff = t->stalled && pool_push_lock(m->requeue_pool, c) == 0;
+		if (handoff)
+			pr_notice("thread[%d]: hand off chunk 0x%010lx-0x%010lx", t->id,
+				  c->off, c->off + c->len);
+
+		if (mscp_copy_thread_reconnect(t) < 0)
+			return -1;
+		if (handoff)
+			return 0;
+	}
+}
+
+static struct chunk *mscp_copy_thread_next_chunk(struct mscp_thread *t)
+{
+	struct mscp *m = t->m;
+	struct chunk *c;
+
+	/* chunks handed off by stalled threads go first */
+	if (!(c = pool_iter_next_lock(m->requeue_pool)))
+		c = pool_iter_next_lock(m->chunk_pool);
+
+	if (c)
+		__sync_add_and_fetch(&m->nr_copying, 1);
+
+	LOCK_ACQUIRE(&t->sftp_lock);
+	t->chunk = c;
+	t->stalled = false;
+	LOCK_RELEASE();
+
+	return c;
+}
+
+void *mscp_copy_thread(void *arg)
+{
+	struct mscp_thread *t = arg;
+	struct mscp *m = t->m;
+	struct chunk *c;
+	bool next_chunk_exist;
+	int ret;
+
+	/* when error occurs, each thread prints error messages
+	 * immediately with pr_* functions. */
+
+	trace_thread_name("thread[%d]", t->id);
+
+	if (mscp_copy_thread_place(t) < 0)
+		goto err_out;
+
+	t->state = THREAD_STATE_CONNECTING;
+
 	if (sem_wait(m->sem) < 0) {
 		pr_err("sem_wait: %s", strerrno());
 		goto err_out;
 	}
 
-	if ((next_chunk_exist = pool_iter_has_next_lock(m->chunk_pool))) {
-		if (m->opts->interval > 0)
-			wait_for_interval(m->opts->interval);
-		pr_notice("thread[%d]: connecting to %s", t->id, m->remote);
-		
-		// 为当前线程设置对应的网卡
-		const char *netdev = get_netdev_by_index(t->netdev_index);
-		if (netdev) {
-			m->ssh_opts->bind_dev = netdev;
-			pr_notice("thread[%d]: using network device %s", t->id, netdev);
-		}
-		
-		t->sftp = ssh_init_sftp_session(m->remote, m->ssh_opts);
-		
-		// 移除旧的绑定逻辑，现在在 ssh_init_session 中处理
-	}
+	if ((next_chunk_exist = pool_iter_has_next_lock(m->chunk_pool)))
+		mscp_copy_thread_connect(t);
 
 	if (sem_post(m->sem) < 0) {
 		pr_err("sem_post: %s", strerrno());
@@ -710,39 +1403,44 @@ void *mscp_copy_thread(void *arg)
 		goto err_out;
 	}
 
-	switch (m->direction) {
-	case MSCP_DIRECTION_L2R:
-		src_sftp = NULL;
-		dst_sftp = t->sftp;
-		break;
-	case MSCP_DIRECTION_R2L:
-		src_sftp = t->sftp;
-		dst_sftp = NULL;
-		break;
-	default:
-		assert(false);
-		goto err_out; /* not reached */
-	}
+	t->state = THREAD_STATE_RUNNING;
 
-	// 在线程开始时打印
-	pr_notice("thread[%d] using device %s starting", t->id, netdev);
 	pr_notice("thread[%d] entering copy loop", t->id);
 	while (1) {
+		if (t->retire) {
+			pr_notice("thread[%d] retired, total transferred: %zu bytes",
+				  t->id, t->stats.copied_bytes);
+			mscp_copy_thread_close(t);
+			break;
+		}
+		if (m->paused) {
+			usleep(10000);
+			continue;
+		}
 		pr_debug("thread[%d] waiting for chunk...", t->id);
-		c = pool_iter_next_lock(m->chunk_pool);
+		c = mscp_copy_thread_next_chunk(t);
 		if (c == NULL) {
-			pr_debug("thread[%d] no chunk, pool_size=%d, ready=%d", t->id, pool_size(m->chunk_pool), chunk_pool_is_ready(m));
+			pr_debug("thread[%d] no chunk, pool_size=%zu, ready=%d", t->id, pool_size(m->chunk_pool), chunk_pool_is_ready(m));
 			if (!chunk_pool_is_ready(m)) {
 				usleep(100);
 				continue;
 			}
-			pr_notice("thread[%d] finished, total transferred: %zu bytes", t->id, t->copied_bytes);
+			if (m->opts->stall_timeout > 0 && m->nr_copying > 0) {
+				/* stay to take over chunks from stalled threads */
+				usleep(10000);
+				continue;
+			}
+			pr_notice("thread[%d] finished, total transferred: %zu bytes", t->id, t->stats.copied_bytes);
 			break;
 		}
 		pr_notice("thread[%d] got chunk off=%zu len=%zu state=%d", t->id, c->off, c->len, c->state);
-		int ret = copy_chunk(c, src_sftp, dst_sftp, m->opts->nr_ahead, m->opts->buf_sz, m->opts->preserve_ts, &m->bw, &t->copied_bytes);
+		ret = mscp_copy_thread_copy_chunk(t, c);
+		__sync_sub_and_fetch(&m->nr_copying, 1);
 		pr_notice("thread[%d] copy_chunk ret=%d", t->id, ret);
-		if (ret < 0) break;
+		if (ret < 0) {
+			t->ret = ret;
+			break;
+		}
 	}
 
 	if (t->ret < 0) {
@@ -751,16 +1449,394 @@ void *mscp_copy_thread(void *arg)
 			   priv_get_err());
 	}
 
+	t->state = THREAD_STATE_DONE;
 	return NULL;
 
 err_out:
 	t->ret = -1;
+	t->state = THREAD_STATE_DONE;
 	return NULL;
 out:
 	t->ret = 0;
+	t->state = THREAD_STATE_DONE;
+	return NULL;
+}
+
+/* monitor thread-related functions */
+
+static long mscp_now_msec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void mscp_watchdog(struct mscp *m)
+{
+	struct mscp_thread *t;
+	unsigned int idx;
+	long now = mscp_now_msec();
+
+	/* A copy thread stalls if neither its copied bytes nor its
+	 * chunk change for stall_timeout seconds while copying. Shut
+	 * down the socket of the stalled connection. Then, the copy
+	 * thread fails on the connection, hands off the chunk, and
+	 * reconnects. */
+
+	pool_lock(m->thread_pool);
+	pool_for_each(m->thread_pool, t, idx) {
+		LOCK_ACQUIRE(&t->sftp_lock);
+		if (t->state != THREAD_STATE_RUNNING || !t->chunk || t->stalled ||
+		    t->stats.copied_bytes != t->wd_bytes || t->chunk != t->wd_chunk) {
+			t->wd_bytes = t->stats.copied_bytes;
+			t->wd_chunk = t->chunk;
+			t->wd_time = now;
+		} else if (now - t->wd_time >= m->opts->stall_timeout * 1000 && t->sftp) {
+			pr_warn("thread[%d]: no progress for %d sec, tear down the connection",
+				t->id, m->opts->stall_timeout);
+			ssh_sftp_shutdown(t->sftp);
+			t->stalled = true;
+			m->nr_stalls++;
+		}
+		LOCK_RELEASE();
+	}
+	pool_unlock(m->thread_pool);
+}
+
+static void mscp_account_netdevs(struct mscp *m, size_t *bytes, int *conns)
+{
+	struct mscp_thread *t;
+	struct netdev *dev;
+	unsigned int idx;
+	size_t delta;
+
+	/* account bytes copied by each copy thread since the last call
+	 * to its network device. bytes and conns, indexed by the
+	 * device position, count them and running connections. */
+	pool_lock(m->thread_pool);
+	pool_for_each(m->thread_pool, t, idx) {
+		delta = t->stats.copied_bytes - t->acct_bytes;
+		t->acct_bytes += delta;
+		if (!(dev = get_netdev_by_position(t->netdev_index)))
+			continue;
+		dev->bytes += delta;
+		if (bytes)
+			bytes[t->netdev_index] += delta;
+		if (conns && t->state == THREAD_STATE_RUNNING)
+			conns[t->netdev_index]++;
+	}
+	pool_unlock(m->thread_pool);
+}
+
+static void mscp_steer_netdevs(struct mscp *m, long msec)
+{
+	int n, count = get_netdev_count(), max_weight = 0;
+	int conns[count > 0 ? count : 1], weights[count > 0 ? count : 1];
+	size_t bytes[count > 0 ? count : 1];
+	double rate;
+
+	if (count < 2) {
+		mscp_account_netdevs(m, NULL, NULL);
+		return;
+	}
+
+	memset(bytes, 0, sizeof(bytes));
+	memset(conns, 0, sizeof(conns));
+	mscp_account_netdevs(m, bytes, conns);
+
+	/* Steer new connections toward devices delivering more bytes
+	 * per connection. As connections are added to a saturated
+	 * device, its throughput per connection drops, and new ones
+	 * go to others. Devices without running connections get the
+	 * best weight so that they are probed. */
+	for (n = 0; n < count; n++) {
+		weights[n] = 0;
+		if (conns[n] == 0)
+			continue;
+		rate = (double)bytes[n] * 1000 / msec;
+		pr_info("NIC %s: %.1f MB/s over %d connection(s)",
+			get_netdev_by_position(n)->name, rate / 1000000, conns[n]);
+		weights[n] = max((int)(rate / conns[n] / 1000), 1); /* KB/s */
+		max_weight = max(max_weight, weights[n]);
+	}
+
+	if (max_weight == 0)
+		return;
+
+	for (n = 0; n < count; n++)
+		netdev_set_weight(n, conns[n] ? weights[n] : max_weight);
+}
+
+static void mscp_monitor_sleep(struct mscp *m, long msec)
+{
+	static __thread long last;
+	long now, end = mscp_now_msec() + msec;
+
+	/* sleep for msec while running the watchdog and accounting to
+	 * network devices periodically */
+	while ((now = mscp_now_msec()) < end) {
+		if (m->opts->stall_timeout > 0 && now - last >= WATCHDOG_INTERVAL_MSEC) {
+			mscp_watchdog(m);
+			last = now;
+		}
+		if (now - m->acct_time >= NETDEV_SAMPLE_MSEC) {
+			if (m->acct_time)
+				mscp_steer_netdevs(m, now - m->acct_time);
+			m->acct_time = now;
+		}
+		usleep(min(end - now, WATCHDOG_INTERVAL_MSEC) * 1000);
+	}
+}
+
+static bool mscp_copy_running(struct mscp *m)
+{
+	struct mscp_thread *t;
+	unsigned int idx;
+	bool running = false;
+
+	pool_lock(m->thread_pool);
+	pool_for_each(m->thread_pool, t, idx) {
+		if (t->state != THREAD_STATE_DONE)
+			running = true;
+	}
+	pool_unlock(m->thread_pool);
+
+	return running;
+}
+
+static void mscp_wait_for_connecting(struct mscp *m)
+{
+	struct mscp_thread *t;
+	unsigned int idx;
+	bool connecting;
+
+	/* wait until all copy threads finish establishing their SSH
+	 * connections, so that sampling throughput reflects them. */
+	do {
+		connecting = false;
+		pool_lock(m->thread_pool);
+		pool_for_each(m->thread_pool, t, idx) {
+			if (t->state < THREAD_STATE_RUNNING)
+				connecting = true;
+		}
+		pool_unlock(m->thread_pool);
+		if (connecting)
+			mscp_monitor_sleep(m, 10);
+	} while (connecting);
+}
+
+static double mscp_sample_throughput(struct mscp *m, int msec)
+{
+	struct mscp_stats s;
+	size_t before;
+	long start;
+
+	mscp_get_stats(m, &s);
+	before = s.done;
+	start = mscp_now_msec();
+	mscp_monitor_sleep(m, msec);
+	mscp_get_stats(m, &s);
+
+	return (double)(s.done - before) * 1000 / (mscp_now_msec() - start);
+}
+
+static bool mscp_copy_remains(struct mscp *m)
+{
+	return !chunk_pool_is_ready(m) || pool_iter_has_next_lock(m->chunk_pool) ||
+	       pool_iter_has_next_lock(m->requeue_pool);
+}
+
+static void mscp_retire_copy_threads(struct mscp *m, int from)
+{
+	struct mscp_thread *t;
+	unsigned int idx;
+
+	pool_lock(m->thread_pool);
+	pool_for_each(m->thread_pool, t, idx) {
+		if (idx >= from)
+			t->retire = true;
+	}
+	pool_unlock(m->thread_pool);
+}
+
+static void mscp_adapt_conns(struct mscp *m)
+{
+	int nr = pool_size(m->thread_pool), add, max = m->opts->nr_threads;
+	double prev, rate;
+
+	/* Slow-start on connections: double the number of
+	 * connections (by max_startups at most at once) while the
+	 * aggregate throughput keeps improving. When the gain
+	 * flattens, stop there, and retire the last connections
+	 * added if they did not improve throughput at all. */
+
+	mscp_wait_for_connecting(m);
+	prev = mscp_sample_throughput(m, ADAPTIVE_SAMPLE_MSEC);
+	pr_info("adaptive: %d connections, %.1f MB/s", nr, prev / 1000000);
+
+	while (nr < max && mscp_copy_remains(m)) {
+		add = min(min(nr, m->opts->max_startups), max - nr);
+		add = mscp_spawn_copy_threads(m, add);
+		if (add == 0) {
+			pr_warn("adaptive: failed to add connections: %s", priv_get_err());
+			break;
+		}
+
+		mscp_wait_for_connecting(m);
+		rate = mscp_sample_throughput(m, ADAPTIVE_SAMPLE_MSEC);
+		pr_info("adaptive: %d connections, %.1f MB/s", nr + add, rate / 1000000);
+
+		if (rate < prev * (1 + ADAPTIVE_GAIN)) {
+			if (rate <= prev)
+				mscp_retire_copy_threads(m, nr);
+			else
+				nr += add;
+			break;
+		}
+		prev = rate;
+		nr += add;
+	}
+
+	pr_notice("adaptive: settled on %d connections (pin it with -n %d)", nr, nr);
+}
+
+static void *mscp_monitor_thread(void *arg)
+{
+	struct mscp *m = arg;
+
+	trace_thread_name("monitor", 0);
+
+	if (m->opts->adaptive_conns)
+		mscp_adapt_conns(m);
+
+	if (m->opts->stall_timeout > 0) {
+		while (mscp_copy_running(m))
+			mscp_monitor_sleep(m, WATCHDOG_INTERVAL_MSEC);
+	}
+
+	return NULL;
+}
+
+/* runtime control-related functions */
+
+static void *mscp_control_thread(void *arg)
+{
+	struct mscp *m = arg;
+
+	/* serve until all copy threads finish, so that no threads are
+	 * spawned after mscp_join() starts to join them. */
+	while (mscp_copy_running(m)) {
+		if (control_serve(m->control_fd, m, CONTROL_POLL_MSEC) < 0) {
+			pr_warn("control: %s", priv_get_err());
+			break;
+		}
+	}
+
 	return NULL;
 }
 
+static void *mscp_metrics_thread(void *arg)
+{
+	struct mscp *m = arg;
+	struct metrics *http = NULL, *file = NULL;
+	long next = 0, now;
+
+	/* each has its own last sample for rates */
+	if ((m->metrics_fd >= 0 && !(http = metrics_new())) ||
+	    (m->opts->metrics_file && !(file = metrics_new()))) {
+		pr_warn("metrics: %s", priv_get_err());
+		goto out;
+	}
+
+	while (mscp_copy_running(m)) {
+		if (http) {
+			if (metrics_serve_http(m->metrics_fd, http, m, CONTROL_POLL_MSEC) < 0) {
+				pr_warn("metrics: %s", priv_get_err());
+				break;
+			}
+		} else
+			usleep(CONTROL_POLL_MSEC * 1000);
+
+		if (file && (now = mscp_now_msec()) >= next) {
+			if (metrics_write_file(file, m, m->opts->metrics_file) < 0)
+				pr_warn("metrics: %s", priv_get_err());
+			next = now + METRICS_FILE_INTERVAL_MSEC;
+		}
+	}
+
+	/* the final metrics */
+	if (file && metrics_write_file(file, m, m->opts->metrics_file) < 0)
+		pr_warn("metrics: %s", priv_get_err());
+out:
+	if (http)
+		metrics_free(http);
+	if (file)
+		metrics_free(file);
+	return NULL;
+}
+
+int mscp_set_bitrate(struct mscp *m, size_t bitrate)
+{
+	/* the bucket of the group is the parent of this process's share */
+	if (m->group_bw)
+		bwlimit_set_rate(m->group_bw->parent, bitrate);
+	else
+		bwlimit_set_rate(&m->bw, bitrate);
+
+	m->opts->bitrate = bitrate;
+	pr_notice("bitrate limit: %lu bps", bitrate);
+	return 0;
+}
+
+int mscp_set_nr_threads(struct mscp *m, int nr_threads)
+{
+	struct mscp_thread *t;
+	unsigned int idx;
+	int nr = 0, n;
+
+	if (nr_threads < 1) {
+		priv_set_errv("invalid number of threads: %d", nr_threads);
+		return -1;
+	}
+
+	pool_lock(m->thread_pool);
+	pool_for_each(m->thread_pool, t, idx) {
+		if (!t->retire && t->state != THREAD_STATE_DONE)
+			nr++;
+	}
+	/* retire the newest threads after their current chunks */
+	for (idx = pool_size(m->thread_pool); idx > 0 && nr > nr_threads; idx--) {
+		t = pool_get(m->thread_pool, idx - 1);
+		if (!t->retire && t->state != THREAD_STATE_DONE) {
+			t->retire = true;
+			nr--;
+		}
+	}
+	pool_unlock(m->thread_pool);
+
+	if (nr < nr_threads && mscp_copy_remains(m)) {
+		n = mscp_spawn_copy_threads(m, nr_threads - nr);
+		if (n < nr_threads - nr)
+			return -1;
+	}
+
+	m->opts->nr_threads = nr_threads;
+	pr_notice("number of threads: %d", nr_threads);
+	return 0;
+}
+
+void mscp_pause(struct mscp *m)
+{
+	m->paused = true;
+	pr_notice("paused");
+}
+
+void mscp_resume(struct mscp *m)
+{
+	m->paused = false;
+	pr_notice("resumed");
+}
+
 /* cleanup-related functions */
 
 void mscp_cleanup(struct mscp *m)
@@ -774,17 +1850,32 @@ void mscp_cleanup(struct mscp *m)
 	pool_zeroize(m->path_pool, (pool_map_f)free_path);
 	pool_zeroize(m->chunk_pool, free);
 	pool_zeroize(m->thread_pool, free);
+	pool_zeroize(m->requeue_pool, NULL); /* chunks are in chunk_pool */
 }
 
 void mscp_free(struct mscp *m)
 {
+	if (m->opts->trace && trace_dump() < 0)
+		pr_warn("failed to write trace: %s", priv_get_err());
+
 	pool_destroy(m->src_pool, free);
 	pool_destroy(m->path_pool, (pool_map_f)free_path);
+	pool_free(m->requeue_pool);
 
 	if (m->remote)
 		free(m->remote);
 	if (m->cores)
 		free(m->cores);
+	if (m->core_nodes)
+		free(m->core_nodes);
+	if (m->core_users)
+		free(m->core_users);
+	if (m->raddrs)
+		free_remote_addrs(m->raddrs, m->nr_raddrs);
+	if (m->nic_bw)
+		free(m->nic_bw);
+	if (m->group_bw)
+		bwlimit_group_detach(m->group_bw);
 
 	sem_release(m->sem);
 	free(m);
@@ -797,8 +1888,84 @@ void mscp_get_stats(struct mscp *m, struct mscp_stats *s)
 
 	s->total = m->total_bytes;
 	s->done = 0;
+	s->retries = m->nr_retries;
+	s->stalls = m->nr_stalls;
 
+	/* the monitor thread may add copy threads while copying */
+	pool_lock(m->thread_pool);
 	pool_for_each(m->thread_pool, t, idx) {
-		s->done += t->copied_bytes;
+		s->done += t->stats.copied_bytes;
 	}
+	pool_unlock(m->thread_pool);
+}
+
+int mscp_get_stats_ext(struct mscp *m, struct mscp_stats_ext *s)
+{
+	struct mscp_thread_stats *ts;
+	struct mscp_thread *t;
+	struct netdev *dev;
+	unsigned int idx;
+	size_t opened = 0, stride;
+	int n;
+
+	if (s->version < 1 || s->version > MSCP_STATS_VERSION) {
+		priv_set_errv("unsupported stats version: %d", s->version);
+		return -1;
+	}
+
+	/* struct mscp_thread_stats of version 1 ends before tm */
+	stride = s->version < 2 ? offsetof(struct mscp_thread_stats, tm) : sizeof(*ts);
+
+	s->total = m->total_bytes;
+	s->done = 0;
+	s->retries = m->nr_retries;
+	s->stalls = m->nr_stalls;
+
+	s->scan_done = chunk_pool_is_ready(m);
+	s->files_total = pool_size(m->path_pool);
+	s->files_done = 0;
+	memset(s->lat_hist, 0, sizeof(s->lat_hist));
+
+	s->nr_threads = 0;
+	pool_lock(m->thread_pool);
+	pool_for_each(m->thread_pool, t, idx) {
+		s->done += t->stats.copied_bytes;
+		s->files_done += t->stats.nr_files_done;
+		opened += t->stats.nr_files_opened;
+		for (n = 0; n < MSCP_LAT_HIST_BUCKETS; n++)
+			s->lat_hist[n] += t->stats.lat_hist[n];
+
+		if (!s->threads || s->nr_threads >= s->max_threads)
+			continue;
+		ts = (void *)s->threads + stride * s->nr_threads++;
+		ts->id = t->id;
+		ts->state = t->state;
+		dev = get_netdev_by_position(t->netdev_index);
+		ts->netdev = dev ? dev->name : NULL;
+		ts->remote_addr = t->raddr ? t->raddr->addr : NULL;
+		ts->bytes = t->stats.copied_bytes;
+		ts->chunks = t->stats.nr_chunks;
+		LOCK_ACQUIRE(&t->sftp_lock);
+		ts->chunk_path = t->chunk ? t->chunk->p->path : NULL;
+		ts->chunk_off = t->chunk ? t->chunk->off : 0;
+		ts->chunk_len = t->chunk ? t->chunk->len : 0;
+		LOCK_RELEASE();
+		if (s->version >= 2)
+			ts->tm = t->stats.tm.result;
+	}
+	if (!s->threads)
+		s->nr_threads = pool_size(m->thread_pool);
+	pool_unlock(m->thread_pool);
+
+	/* a file is opened and finalized once by any thread */
+	s->files_inflight = opened - s->files_done;
+
+	return 0;
+}
+
+size_t mscp_lat_hist_usec(int bucket)
+{
+	if (bucket < 8)
+		return bucket;
+	return (size_t)(8 + bucket % 8) << (bucket / 8 - 1);
 }
@@ -8,13 +8,74 @@
 #include <linux/if_ether.h>
 #include <linux/sockios.h>
 #include <errno.h>
+#include <ifaddrs.h>
+#include <pthread.h>
 #include <print.h>
 #include "netdev.h"
 
 struct netdev *netdev_list = NULL;
 
+// 保护 current_weight 和 weight：新连接和重连可能并发选择网卡
+static pthread_mutex_t netdev_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// 读取 /sys/class/net/<dev>/speed (Mbps)，虚拟网卡或链路断开时返回 -1
+static int read_netdev_speed(const char *name)
+{
+    char path[64 + IFNAMSIZ];
+    FILE *fp;
+    int speed;
+
+    snprintf(path, sizeof(path), "/sys/class/net/%s/speed", name);
+    if (!(fp = fopen(path, "r")))
+        return -1;
+    if (fscanf(fp, "%d", &speed) != 1 || speed <= 0)
+        speed = -1;
+    fclose(fp);
+    return speed;
+}
+
+// 读取 /sys/class/net/<dev>/device/numa_node，虚拟网卡没有 device
+static int read_netdev_numa_node(const char *name)
+{
+    char path[64 + IFNAMSIZ];
+    FILE *fp;
+    int node;
+
+    snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node", name);
+    if (!(fp = fopen(path, "r")))
+        return -1;
+    if (fscanf(fp, "%d", &node) != 1)
+        node = -1;
+    fclose(fp);
+    return node;
+}
+
+// 未指定权重时按链路速率分配连接；速率未知的网卡按已知最低速率计算，
+// 全部未知时平均分配
+static void set_netdev_weights(void)
+{
+    struct netdev *dev;
+    int min_speed = 0;
+
+    for (dev = netdev_list; dev; dev = dev->next) {
+        if (dev->weight > 0 || dev->speed <= 0)
+            continue;
+        if (min_speed == 0 || dev->speed < min_speed)
+            min_speed = dev->speed;
+    }
+
+    for (dev = netdev_list; dev; dev = dev->next) {
+        if (dev->weight > 0)
+            continue;
+        if (min_speed == 0)
+            dev->weight = 1;
+        else
+            dev->weight = dev->speed > 0 ? dev->speed : min_speed;
+    }
+}
+
 // 支持指定网卡名列表
-int get_netdev_list(const char **devnames, int devcount)
+int get_netdev_list(const char **devnames, const int *weights, int devcount)
 {
     struct ifconf ifc;
     struct ifreq *ifr;
@@ -42,7 +103,7 @@ int get_netdev_list(const char **devnames, int devcount)
 
     for (i = 0; i < n; i++) {
         struct ifreq *item = &ifr[i];
-        int use = 1;
+        int use = 1, weight = 0;
         // 跳过lo
         if (strcmp(item->ifr_name, "lo") == 0)
             continue;
@@ -52,6 +113,7 @@ int get_netdev_list(const char **devnames, int devcount)
             for (int j = 0; j < devcount; ++j) {
                 if (strcmp(item->ifr_name, devnames[j]) == 0) {
                     use = 1;
+                    weight = weights ? weights[j] : 0;
                     break;
                 }
             }
@@ -68,6 +130,12 @@ int get_netdev_list(const char **devnames, int devcount)
 
         strncpy(dev->name, item->ifr_name, IFNAMSIZ);
         dev->index = if_nametoindex(item->ifr_name);
+        dev->speed = read_netdev_speed(dev->name);
+        dev->numa_node = read_netdev_numa_node(dev->name);
+        dev->weight = weight;
+        dev->user_weight = weight > 0;
+        dev->current_weight = 0;
+        dev->bytes = 0;
         dev->next = NULL;
         // 获取MAC
         struct ifreq ifr_mac;
@@ -91,7 +159,8 @@ int get_netdev_list(const char **devnames, int devcount)
         } else {
             strcpy(dev->ip, "N/A");
         }
-        pr_notice("NIC: %s, MAC: %s, IP: %s", dev->name, dev->mac, dev->ip);
+        pr_notice("NIC: %s, MAC: %s, IP: %s, speed: %d Mbps, numa node: %d",
+                  dev->name, dev->mac, dev->ip, dev->speed, dev->numa_node);
 
         if (!netdev_list) {
             netdev_list = dev;
@@ -103,6 +172,18 @@ int get_netdev_list(const char **devnames, int devcount)
     }
 
     close(sock);
+
+    // 指定了但没有找到（或没有 IPv4 地址）的网卡
+    for (i = 0; devnames && i < devcount; i++) {
+        for (dev = netdev_list; dev; dev = dev->next) {
+            if (strcmp(dev->name, devnames[i]) == 0)
+                break;
+        }
+        if (!dev)
+            pr_warn("network device %s not found", devnames[i]);
+    }
+
+    set_netdev_weights();
     return 0;
 }
 
@@ -162,7 +243,7 @@ int bind_socket_to_netdev(int sock, const char *devname)
     return 0;
 }
 
-static struct netdev *get_netdev_by_position(int position)
+struct netdev *get_netdev_by_position(int position)
 {
     struct netdev *dev;
     int count = get_netdev_count();
@@ -187,12 +268,12 @@ const char *get_netdev_by_index(int index)
 {
     struct netdev *dev;
 
-    if (!netdev_list && get_netdev_list(NULL, 0) < 0)
+    if (!netdev_list && get_netdev_list(NULL, NULL, 0) < 0)
         return NULL;
 
     dev = get_netdev_by_position(index);
     if (dev) {
-        pr_notice("Mapped thread index %d to network device: %s", index, dev->name);
+        pr_debug("Mapped thread index %d to network device: %s", index, dev->name);
         return dev->name;
     }
 
@@ -205,11 +286,170 @@ int get_netdev_count(void)
     struct netdev *dev;
     int count = 0;
 
-    if (!netdev_list && get_netdev_list(NULL, 0) < 0)
+    if (!netdev_list && get_netdev_list(NULL, NULL, 0) < 0)
         return -1;
 
     for (dev = netdev_list; dev; dev = dev->next)
         count++;
 
     return count;
-} 
\ No newline at end of file
+}
+
+// smooth weighted round-robin (as nginx upstream): each pick adds the
+// weight to current_weight of every device, and the device with the
+// largest current_weight is chosen and decreased by the total weight.
+// This interleaves devices instead of assigning them in bursts.
+static int netdev_pick(void)
+{
+    struct netdev *dev, *best = NULL;
+    int pos, best_pos = -1, total = 0;
+
+    for (dev = netdev_list, pos = 0; dev; dev = dev->next, pos++) {
+        dev->current_weight += dev->weight;
+        total += dev->weight;
+        if (!best || dev->current_weight > best->current_weight) {
+            best = dev;
+            best_pos = pos;
+        }
+    }
+
+    if (best)
+        best->current_weight -= total;
+    return best_pos;
+}
+
+int netdev_next_index(void)
+{
+    int pos;
+
+    if (get_netdev_count() <= 0)
+        return -1;
+
+    pthread_mutex_lock(&netdev_lock);
+    pos = netdev_pick();
+    pthread_mutex_unlock(&netdev_lock);
+    return pos;
+}
+
+void netdev_set_weight(int position, int weight)
+{
+    struct netdev *dev = get_netdev_by_position(position), *d;
+
+    if (!dev || weight <= 0)
+        return;
+
+    // 用户指定的权重保持不变
+    for (d = netdev_list; d; d = d->next) {
+        if (d->user_weight)
+            return;
+    }
+
+    pthread_mutex_lock(&netdev_lock);
+    dev->weight = weight;
+    pthread_mutex_unlock(&netdev_lock);
+}
+
+void netdev_print_plan(int nr_conns)
+{
+    struct netdev *dev;
+    int n, pos, count = get_netdev_count();
+    int conns[count > 0 ? count : 1], saved[count > 0 ? count : 1];
+
+    if (count <= 0)
+        return;
+
+    pthread_mutex_lock(&netdev_lock);
+    // simulate the picks for nr_conns connections, and restore the
+    // state so that the actual assignment follows the plan
+    for (dev = netdev_list, pos = 0; dev; dev = dev->next, pos++) {
+        saved[pos] = dev->current_weight;
+        conns[pos] = 0;
+    }
+    for (n = 0; n < nr_conns; n++)
+        conns[netdev_pick()]++;
+    for (dev = netdev_list, pos = 0; dev; dev = dev->next, pos++)
+        dev->current_weight = saved[pos];
+    pthread_mutex_unlock(&netdev_lock);
+
+    for (dev = netdev_list, pos = 0; dev; dev = dev->next, pos++)
+        pr_notice("NIC plan: %s weight %d, %d/%d connection(s)", dev->name,
+                  dev->weight, conns[pos], nr_conns);
+}
+
+int netdev_get_addr(const char *devname, int family, struct sockaddr_storage *ss,
+                    socklen_t *len)
+{
+    struct ifaddrs *ifa_list, *ifa;
+    int ret = -1;
+
+    if (getifaddrs(&ifa_list) < 0) {
+        pr_err("getifaddrs: %s", strerror(errno));
+        return -1;
+    }
+
+    for (ifa = ifa_list; ifa; ifa = ifa->ifa_next) {
+        if (!ifa->ifa_addr || ifa->ifa_addr->sa_family != family ||
+            strcmp(ifa->ifa_name, devname) != 0)
+            continue;
+        // IPv6 链路本地地址需要 scope id，不用于 bind
+        if (family == AF_INET6 &&
+            IN6_IS_ADDR_LINKLOCAL(&((struct sockaddr_in6 *)ifa->ifa_addr)->sin6_addr))
+            continue;
+        *len = family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+        memcpy(ss, ifa->ifa_addr, *len);
+        ret = 0;
+        break;
+    }
+
+    freeifaddrs(ifa_list);
+    return ret;
+}
+
+static bool addr_masked_equal(const unsigned char *a, const unsigned char *b,
+                              const unsigned char *mask, size_t len)
+{
+    size_t n;
+
+    for (n = 0; n < len; n++) {
+        if ((a[n] & mask[n]) != (b[n] & mask[n]))
+            return false;
+    }
+    return true;
+}
+
+bool netdev_in_subnet(const char *devname, const struct sockaddr *sa)
+{
+    struct ifaddrs *ifa_list, *ifa;
+    const unsigned char *a, *b, *mask;
+    size_t len;
+    bool ret = false;
+
+    if (getifaddrs(&ifa_list) < 0) {
+        pr_err("getifaddrs: %s", strerror(errno));
+        return false;
+    }
+
+    for (ifa = ifa_list; ifa && !ret; ifa = ifa->ifa_next) {
+        if (!ifa->ifa_addr || !ifa->ifa_netmask || ifa->ifa_addr->sa_family != sa->sa_family ||
+            strcmp(ifa->ifa_name, devname) != 0)
+            continue;
+
+        if (sa->sa_family == AF_INET) {
+            a = (unsigned char *)&((struct sockaddr_in *)ifa->ifa_addr)->sin_addr;
+            b = (unsigned char *)&((struct sockaddr_in *)sa)->sin_addr;
+            mask = (unsigned char *)&((struct sockaddr_in *)ifa->ifa_netmask)->sin_addr;
+            len = sizeof(struct in_addr);
+        } else if (sa->sa_family == AF_INET6) {
+            a = (unsigned char *)&((struct sockaddr_in6 *)ifa->ifa_addr)->sin6_addr;
+            b = (unsigned char *)&((struct sockaddr_in6 *)sa)->sin6_addr;
+            mask = (unsigned char *)&((struct sockaddr_in6 *)ifa->ifa_netmask)->sin6_addr;
+            len = sizeof(struct in6_addr);
+        } else
+            continue;
+
+        ret = addr_masked_equal(a, b, mask, len);
+    }
+
+    freeifaddrs(ifa_list);
+    return ret;
+}
@@ -1,6 +1,8 @@
 #ifndef NETDEV_H
 #define NETDEV_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <net/if.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -10,6 +12,12 @@ struct netdev {
     int index;
     char mac[18];
     char ip[INET_ADDRSTRLEN];
+    int speed;          /* link speed in Mbps, -1 if unknown */
+    int numa_node;      /* NUMA node of the device, -1 if unknown */
+    int weight;         /* share of connections */
+    int current_weight; /* state of smooth weighted round-robin */
+    bool user_weight;   /* weight is given by the user */
+    size_t bytes;       /* bytes copied over this device */
     struct netdev *next;
 };
 
@@ -18,6 +26,34 @@ const char *get_netdev_by_index(int index);
 int get_netdev_count(void);
 void free_netdev_list(void);
 // 新增：支持指定网卡名列表
-int get_netdev_list(const char **devnames, int devcount);
+// weights gives the share of connections for each of devnames. When
+// weights is NULL, the link speed in /sys/class/net/<dev>/speed is used.
+int get_netdev_list(const char **devnames, const int *weights, int devcount);
+
+// netdev_next_index() returns the position of the network device for a
+// new connection by smooth weighted round-robin, or -1 if no device.
+int netdev_next_index(void);
+
+// netdev_print_plan() prints how nr_conns connections are distributed
+// over the network devices.
+void netdev_print_plan(int nr_conns);
+
+// get_netdev_by_position() returns the network device at the position
+// returned by netdev_next_index(), or NULL.
+struct netdev *get_netdev_by_position(int position);
+
+// netdev_set_weight() changes the weight of the network device at the
+// position, unless weights are given by the user. New connections
+// follow the new weight.
+void netdev_set_weight(int position, int weight);
+
+// netdev_get_addr() stores an address of the family on the device to
+// *ss, and returns 0, or -1 if the device has no such address.
+int netdev_get_addr(const char *devname, int family, struct sockaddr_storage *ss,
+                    socklen_t *len);
+
+// netdev_in_subnet() returns true if sa is in a subnet of an address
+// on the device.
+bool netdev_in_subnet(const char *devname, const struct sockaddr *sa);
 
 #endif /* NETDEV_H */ 
\ No newline at end of file
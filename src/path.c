@@ -13,6 +13,10 @@
 #include <path.h>
 #include <strerrno.h>
 #include <print.h>
+#include <trace.h>
+
+/* disk i/o taking this or longer is traced as a stall */
+#define DISK_STALL_USEC 1000
 
 /* paths of copy source resoltion */
 static char *resolve_dst_path(const char *src_file_path, struct path_resolve_args *a)
@@ -226,6 +230,12 @@ static int walk_path_recursive(sftp_session sftp, const char *path,
 		return append_path(sftp, path, st, a);
 	}
 
+	if (S_ISCHR(st.st_mode) && a->dev_size) {
+		/* read a device, e.g., /dev/zero, as a dev_size file */
+		st.st_size = a->dev_size;
+		return append_path(sftp, path, st, a);
+	}
+
 	if (!S_ISDIR(st.st_mode))
 		return 0; /* not a regular file and not a directory, skip it. */
 
@@ -317,7 +327,8 @@ next:
 	return 0;
 }
 
-static int prepare_dst_path(struct path *p, sftp_session dst_sftp)
+static int prepare_dst_path(struct path *p, sftp_session dst_sftp,
+			    struct copy_stats *stats)
 {
 	int ret = 0;
 
@@ -328,6 +339,7 @@ static int prepare_dst_path(struct path *p, sftp_session dst_sftp)
 			goto out;
 		}
 		p->state = FILE_STATE_OPENED;
+		stats->nr_files_opened++;
 		pr_info("copy start: %s", p->path);
 	}
 
@@ -338,20 +350,51 @@ out:
 
 /* functions for copy */
 
+static uint64_t now_usec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* account an acknowledged request and sample telemetry */
+#define request_done(stats, start, sf)						\
+	do {									\
+		uint64_t __now = now_usec();					\
+		(stats)->lat_hist[lat_hist_bucket(__now - (start))]++;		\
+		telemetry_tick(&(stats)->tm, ssh_get_fd(sftp_ssh((sf)->sftp)), __now); \
+	} while (0)
+
+#define wait_bwlimit(stats, bw, len) \
+	((stats)->tm.wait_usec += bwlimit_wait(bw, len) / 1000)
+
+struct read_to_buf_args {
+	int fd;
+	struct copy_stats *stats;
+};
+
 static ssize_t read_to_buf(void *ptr, size_t len, void *userdata)
 {
-	int fd = *((int *)userdata);
-	return read(fd, ptr, len);
+	struct read_to_buf_args *a = userdata;
+	uint64_t start = now_usec();
+	ssize_t ret;
+
+	ret = read(a->fd, ptr, len);
+	a->stats->tm.disk_usec += now_usec() - start;
+	trace_event_stall("disk_read_stall", start, DISK_STALL_USEC, NULL, 0, len);
+	return ret;
 }
 
 static int copy_chunk_l2r(struct chunk *c, int fd, sftp_file sf, int nr_ahead, int buf_sz,
-			  struct bwlimit *bw, size_t *counter)
+			  struct bwlimit *bw, struct copy_stats *stats)
 {
+	struct read_to_buf_args a = { .fd = fd, .stats = stats };
 	ssize_t read_bytes, remaind, thrown;
 	int idx, ret;
 	struct {
 		uint32_t id;
 		ssize_t len;
+		uint64_t start; /* usec */
 	} reqs[nr_ahead];
 
 	if (c->len == 0)
@@ -360,7 +403,8 @@ static int copy_chunk_l2r(struct chunk *c, int fd, sftp_file sf, int nr_ahead, i
 	remaind = thrown = c->len;
 	for (idx = 0; idx < nr_ahead && thrown > 0; idx++) {
 		reqs[idx].len = min(thrown, buf_sz);
-		reqs[idx].len = sftp_async_write(sf, read_to_buf, reqs[idx].len, &fd,
+		reqs[idx].start = now_usec();
+		reqs[idx].len = sftp_async_write(sf, read_to_buf, reqs[idx].len, &a,
 						 &reqs[idx].id);
 		if (reqs[idx].len < 0) {
 			priv_set_errv("sftp_async_write: %s",
@@ -368,7 +412,7 @@ static int copy_chunk_l2r(struct chunk *c, int fd, sftp_file sf, int nr_ahead, i
 			return -1;
 		}
 		thrown -= reqs[idx].len;
-		bwlimit_wait(bw, reqs[idx].len);
+		wait_bwlimit(stats, bw, reqs[idx].len);
 	}
 
 	for (idx = 0; remaind > 0; idx = (idx + 1) % nr_ahead) {
@@ -379,7 +423,8 @@ static int copy_chunk_l2r(struct chunk *c, int fd, sftp_file sf, int nr_ahead, i
 			return -1;
 		}
 
-		*counter += reqs[idx].len;
+		request_done(stats, reqs[idx].start, sf);
+		stats->copied_bytes += reqs[idx].len;
 		remaind -= reqs[idx].len;
 
 		if (remaind <= 0)
@@ -389,7 +434,8 @@ static int copy_chunk_l2r(struct chunk *c, int fd, sftp_file sf, int nr_ahead, i
 			continue;
 
 		reqs[idx].len = min(thrown, buf_sz);
-		reqs[idx].len = sftp_async_write(sf, read_to_buf, reqs[idx].len, &fd,
+		reqs[idx].start = now_usec();
+		reqs[idx].len = sftp_async_write(sf, read_to_buf, reqs[idx].len, &a,
 						 &reqs[idx].id);
 		if (reqs[idx].len < 0) {
 			priv_set_errv("sftp_async_write: %s",
@@ -397,7 +443,7 @@ static int copy_chunk_l2r(struct chunk *c, int fd, sftp_file sf, int nr_ahead, i
 			return -1;
 		}
 		thrown -= reqs[idx].len;
-		bwlimit_wait(bw, reqs[idx].len);
+		wait_bwlimit(stats, bw, reqs[idx].len);
 	}
 
 	if (remaind < 0) {
@@ -411,14 +457,16 @@ static int copy_chunk_l2r(struct chunk *c, int fd, sftp_file sf, int nr_ahead, i
 }
 
 static int copy_chunk_r2l(struct chunk *c, sftp_file sf, int fd, int nr_ahead, int buf_sz,
-			  struct bwlimit *bw, size_t *counter)
+			  struct bwlimit *bw, struct copy_stats *stats)
 {
 	ssize_t read_bytes, write_bytes, remaind, thrown;
 	char buf[buf_sz];
+	uint64_t start;
 	int idx;
 	struct {
 		int id;
 		ssize_t len;
+		uint64_t start; /* usec */
 	} reqs[nr_ahead];
 
 	if (c->len == 0)
@@ -428,6 +476,7 @@ static int copy_chunk_r2l(struct chunk *c, sftp_file sf, int fd, int nr_ahead, i
 
 	for (idx = 0; idx < nr_ahead && thrown > 0; idx++) {
 		reqs[idx].len = min(thrown, sizeof(buf));
+		reqs[idx].start = now_usec();
 		reqs[idx].id = sftp_async_read_begin(sf, reqs[idx].len);
 		if (reqs[idx].id < 0) {
 			priv_set_errv("sftp_async_read_begin: %d",
@@ -435,7 +484,7 @@ static int copy_chunk_r2l(struct chunk *c, sftp_file sf, int fd, int nr_ahead, i
 			return -1;
 		}
 		thrown -= reqs[idx].len;
-		bwlimit_wait(bw, reqs[idx].len);
+		wait_bwlimit(stats, bw, reqs[idx].len);
 	}
 
 	for (idx = 0; remaind > 0; idx = (idx + 1) % nr_ahead) {
@@ -444,15 +493,21 @@ static int copy_chunk_r2l(struct chunk *c, sftp_file sf, int fd, int nr_ahead, i
 			priv_set_errv("sftp_async_read: %d", sftp_get_error(sf->sftp));
 			return -1;
 		}
+		request_done(stats, reqs[idx].start, sf);
 
 		if (thrown > 0) {
 			reqs[idx].len = min(thrown, sizeof(buf));
+			reqs[idx].start = now_usec();
 			reqs[idx].id = sftp_async_read_begin(sf, reqs[idx].len);
 			thrown -= reqs[idx].len;
-			bwlimit_wait(bw, reqs[idx].len);
+			wait_bwlimit(stats, bw, reqs[idx].len);
 		}
 
+		start = now_usec();
 		write_bytes = write(fd, buf, read_bytes);
+		stats->tm.disk_usec += now_usec() - start;
+		trace_event_stall("disk_write_stall", start, DISK_STALL_USEC, NULL, 0,
+				  read_bytes);
 		if (write_bytes < 0) {
 			priv_set_errv("write: %s", strerrno());
 			return -1;
@@ -463,7 +518,7 @@ static int copy_chunk_r2l(struct chunk *c, sftp_file sf, int fd, int nr_ahead, i
 			return -1;
 		}
 
-		*counter += write_bytes;
+		stats->copied_bytes += write_bytes;
 		remaind -= read_bytes;
 	}
 
@@ -478,34 +533,34 @@ static int copy_chunk_r2l(struct chunk *c, sftp_file sf, int fd, int nr_ahead, i
 }
 
 static int _copy_chunk(struct chunk *c, mf *s, mf *d, int nr_ahead, int buf_sz,
-		       struct bwlimit *bw, size_t *counter)
+		       struct bwlimit *bw, struct copy_stats *stats)
 {
 	if (s->local && d->remote) /* local to remote copy */
 		return copy_chunk_l2r(c, s->local, d->remote, nr_ahead, buf_sz, bw,
-				      counter);
+				      stats);
 	else if (s->remote && d->local) /* remote to local copy */
 		return copy_chunk_r2l(c, s->remote, d->local, nr_ahead, buf_sz, bw,
-				      counter);
+				      stats);
 
 	assert(false);
 	return -1; /* not reached */
 }
 
-int copy_chunk(struct chunk *c, sftp_session src_sftp, sftp_session dst_sftp,
-	       int nr_ahead, int buf_sz, bool preserve_ts, struct bwlimit *bw,
-	       size_t *counter)
+static int copy_chunk_data(struct chunk *c, sftp_session src_sftp, sftp_session dst_sftp,
+			   int nr_ahead, int buf_sz, struct bwlimit *bw, struct copy_stats *stats)
 {
 	pr_debug("copy_chunk: %s -> %s, off=%zu, len=%zu", c->p->path, c->p->dst_path, c->off, c->len);
 	mode_t mode;
 	int flags;
+	uint64_t start;
 	mf *s, *d;
 	int ret;
 
-	assert((src_sftp && !dst_sftp) || (!src_sftp && dst_sftp));
-
-	if (prepare_dst_path(c->p, dst_sftp) < 0)
+	if (prepare_dst_path(c->p, dst_sftp, stats) < 0)
 		return -1;
 
+	start = trace_begin();
+
 	/* open src */
 	flags = O_RDONLY;
 	mode = S_IRUSR;
@@ -530,38 +585,62 @@ int copy_chunk(struct chunk *c, sftp_session src_sftp, sftp_session dst_sftp,
 		pr_err("mscp_lseek failed: %s, off=%zu, errno=%d (%s)", c->p->dst_path, c->off, errno, strerror(errno));
 		return -1;
 	}
+	trace_event("open", start, c->p->path, c->off, c->len);
 
 	c->state = CHUNK_STATE_COPING;
 	pr_debug("copy chunk start: %s 0x%lx-0x%lx", c->p->path, c->off, c->off + c->len);
 
-	ret = _copy_chunk(c, s, d, nr_ahead, buf_sz, bw, counter);
+	ret = _copy_chunk(c, s, d, nr_ahead, buf_sz, bw, stats);
 
 	pr_debug("copy_chunk: done, ret=%d", ret);
 	pr_debug("copy chunk done: %s 0x%lx-0x%lx", c->p->path, c->off, c->off + c->len);
 
+	start = trace_begin();
 	mscp_close(d);
 	mscp_close(s);
-	if (ret < 0)
-		return ret;
+	trace_event("close", start, c->p->path, c->off, c->len);
+	return ret;
+}
 
-	if (refcnt_dec(&c->p->refcnt) == 0) {
-		struct stat st;
-		c->p->state = FILE_STATE_DONE;
+int copy_chunk(struct chunk *c, sftp_session src_sftp, sftp_session dst_sftp,
+	       int nr_ahead, int buf_sz, bool preserve_ts, struct bwlimit *bw,
+	       struct copy_stats *stats)
+{
+	struct stat st;
+	uint64_t start;
 
-		/* sync stat */
-		if (mscp_stat(c->p->path, &st, src_sftp) < 0) {
-			priv_set_errv("mscp_stat: %s: %s", c->p->path, strerrno());
-			return -1;
-		}
-		if (mscp_setstat(c->p->dst_path, &st, preserve_ts, dst_sftp) < 0) {
-			priv_set_errv("mscp_setstat: %s: %s", c->p->path, strerrno());
+	assert((src_sftp && !dst_sftp) || (!src_sftp && dst_sftp));
+
+	if (c->state != CHUNK_STATE_COPIED) {
+		if (copy_chunk_data(c, src_sftp, dst_sftp, nr_ahead, buf_sz, bw, stats) < 0)
 			return -1;
+
+		c->state = CHUNK_STATE_COPIED;
+		stats->nr_chunks++;
+		if (refcnt_dec(&c->p->refcnt) > 0) {
+			c->state = CHUNK_STATE_DONE;
+			return 0;
 		}
-		pr_info("copy done: %s", c->p->path);
 	}
 
-	if (ret == 0)
-		c->state = CHUNK_STATE_DONE;
+	/* this is the last chunk of the path. sync stat */
+	start = trace_begin();
+	if (mscp_stat(c->p->path, &st, src_sftp) < 0) {
+		priv_set_errv("mscp_stat: %s: %s", c->p->path, strerrno());
+		return -1;
+	}
+	/* do not copy the size and the mode of devices to dst, which
+	 * may be a device, e.g., /dev/null */
+	if (S_ISREG(st.st_mode) &&
+	    mscp_setstat(c->p->dst_path, &st, preserve_ts, dst_sftp) < 0) {
+		priv_set_errv("mscp_setstat: %s: %s", c->p->path, strerrno());
+		return -1;
+	}
+	trace_event("setstat", start, c->p->path, 0, 0);
+	c->p->state = FILE_STATE_DONE;
+	c->state = CHUNK_STATE_DONE;
+	stats->nr_files_done++;
+	pr_info("copy done: %s", c->p->path);
 
-	return ret;
+	return 0;
 }
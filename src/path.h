@@ -10,6 +10,9 @@
 #include <atomic.h>
 #include <ssh.h>
 #include <bwlimit.h>
+#include <minmax.h>
+#include <mscp.h>
+#include <telemetry.h>
 
 struct path {
 	char *path; /* file path */
@@ -35,6 +38,7 @@ struct chunk {
 #define CHUNK_STATE_INIT 0
 #define CHUNK_STATE_COPING 1
 #define CHUNK_STATE_DONE 2
+#define CHUNK_STATE_COPIED 3 /* data copied, but the path is not finalized yet */
 };
 
 struct chunk *alloc_chunk(struct path *p, size_t off, size_t len);
@@ -56,6 +60,8 @@ struct path_resolve_args {
 	size_t min_chunk_sz;
 	size_t max_chunk_sz;
 	size_t chunk_align;
+
+	size_t dev_size; /* size of character devices, 0 skips them */
 };
 
 /* walk src_path recursivly and fill a->path_pool with found files */
@@ -65,9 +71,36 @@ int walk_src_path(sftp_session src_sftp, const char *src_path,
 /* free struct path */
 void free_path(struct path *p);
 
-/* copy a chunk. either src_sftp or dst_sftp is not null, and another is null */
+/* counters of a copy thread. only the thread writes them, and they
+ * occupy their own cache lines, so that readers polling them do not
+ * disturb the thread and other threads. */
+struct copy_stats {
+	size_t copied_bytes;
+	size_t nr_chunks; /* chunks copied */
+	size_t nr_files_opened; /* files opened by this thread */
+	size_t nr_files_done; /* files finalized by this thread */
+	size_t lat_hist[MSCP_LAT_HIST_BUCKETS]; /* sftp request latency */
+	struct telemetry tm; /* of the connection and the thread */
+} __attribute__((aligned(64)));
+
+/* bucket of the latency histogram for usec. buckets are log-linear
+ * (as HdrHistogram): 8 buckets per power of 2, i.e., 12.5% precision. */
+static inline int lat_hist_bucket(uint64_t usec)
+{
+	int e;
+
+	if (usec < 8)
+		return usec;
+	e = 63 - __builtin_clzll(usec);
+	return min((e - 2) * 8 + (int)((usec >> (e - 3)) & 7), MSCP_LAT_HIST_BUCKETS - 1);
+}
+
+/* copy a chunk. either src_sftp or dst_sftp is not null, and another
+ * is null. copy_chunk() can be called again for a failed chunk:
+ * when its data was already copied (CHUNK_STATE_COPIED), it only
+ * finalizes the path. */
 int copy_chunk(struct chunk *c, sftp_session src_sftp, sftp_session dst_sftp,
 	       int nr_ahead, int buf_sz, bool preserve_ts, struct bwlimit *bw,
-	       size_t *counter);
+	       struct copy_stats *stats);
 
 #endif /* _PATH_H_ */
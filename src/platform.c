@@ -7,11 +7,14 @@
 #elif linux
 #define _GNU_SOURCE
 #include <stdlib.h>
+#include <stdio.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <fcntl.h>
 #include <sched.h>
+#include <linux/mempolicy.h>
 #elif __FreeBSD__
 #include <stdlib.h>
 #include <unistd.h>
@@ -105,6 +108,130 @@ int nr_cpus()
 }
 #endif
 
+#ifdef linux
+int nr_numa_nodes(void)
+{
+	char path[64];
+	int n;
+
+	for (n = 0; n < 1024; n++) {
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", n);
+		if (access(path, F_OK) < 0)
+			break;
+	}
+	return n > 0 ? n : 1;
+}
+
+int numa_node_of_cpu(int core)
+{
+	char path[64];
+	int n, nr_nodes = nr_numa_nodes();
+
+	for (n = 0; n < nr_nodes; n++) {
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/node%d", core, n);
+		if (access(path, F_OK) == 0)
+			return n;
+	}
+	return -1;
+}
+
+static int read_node_cpulist(int node, cpu_set_t *cpu_set)
+{
+	char path[64], buf[4096], *p, *end;
+	long first, last;
+	FILE *fp;
+
+	/* cpulist is a comma-separated list of ranges: 0-15,32-47 */
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+	if (!(fp = fopen(path, "r"))) {
+		priv_set_errv("fopen: %s: %s", path, strerrno());
+		return -1;
+	}
+	p = fgets(buf, sizeof(buf), fp);
+	fclose(fp);
+	if (!p) {
+		priv_set_errv("failed to read %s", path);
+		return -1;
+	}
+
+	CPU_ZERO(cpu_set);
+	while (*p && *p != '\n') {
+		first = last = strtol(p, &end, 10);
+		if (end == p)
+			break;
+		if (*end == '-')
+			last = strtol(end + 1, &end, 10);
+		for (; first <= last && first < CPU_SETSIZE; first++)
+			CPU_SET(first, cpu_set);
+		p = (*end == ',') ? end + 1 : end;
+	}
+
+	return 0;
+}
+
+int set_thread_numa_affinity(pthread_t tid, int node)
+{
+	cpu_set_t node_set, allowed_set;
+	int ret;
+
+	if (read_node_cpulist(node, &node_set) < 0)
+		return -1;
+
+	if (sched_getaffinity(0, sizeof(allowed_set), &allowed_set) == 0)
+		CPU_AND(&node_set, &node_set, &allowed_set);
+
+	if (CPU_COUNT(&node_set) == 0) {
+		priv_set_errv("no usable cpu cores on numa node %d", node);
+		return -1;
+	}
+
+	ret = pthread_setaffinity_np(tid, sizeof(node_set), &node_set);
+	if (ret != 0)
+		priv_set_errv("failed to set thread affinity for numa node %d: %s", node,
+			      strerrno());
+	return ret;
+}
+
+int set_numa_mempolicy(int node)
+{
+	unsigned long nodemask[1024 / (8 * sizeof(unsigned long))] = { 0 };
+
+	if (node < 0 || node >= 1024) {
+		priv_set_errv("invalid numa node %d", node);
+		return -1;
+	}
+
+	/* MPOL_PREFERRED falls back to other nodes when the node is
+	 * out of memory, unlike MPOL_BIND. */
+	nodemask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+	if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, nodemask, 1024) < 0) {
+		priv_set_errv("set_mempolicy: %s", strerrno());
+		return -1;
+	}
+	return 0;
+}
+#else
+int nr_numa_nodes(void)
+{
+	return 1;
+}
+
+int numa_node_of_cpu(int core)
+{
+	return -1;
+}
+
+int set_thread_numa_affinity(pthread_t tid, int node)
+{
+	return 0;
+}
+
+int set_numa_mempolicy(int node)
+{
+	return 0;
+}
+#endif
+
 #ifdef __FreeBSD__
 int nr_cpus()
 {
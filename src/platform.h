@@ -10,6 +10,19 @@
 
 int nr_cpus(void);
 int set_thread_affinity(pthread_t tid, int core);
+
+/*
+ * NUMA topology (linux only). nr_numa_nodes() returns the number of
+ * NUMA nodes (1 on non-NUMA systems and other platforms), and
+ * numa_node_of_cpu() returns the node of a cpu core or -1.
+ * set_thread_numa_affinity() pins a thread to the cpu cores of a node
+ * allowed for the process. set_numa_mempolicy() makes the calling
+ * thread prefer allocating memory on a node.
+ */
+int nr_numa_nodes(void);
+int numa_node_of_cpu(int core);
+int set_thread_numa_affinity(pthread_t tid, int node);
+int set_numa_mempolicy(int node);
 int setutimes(const char *path, struct timespec atime, struct timespec mtime);
 
 /*
@@ -37,8 +37,10 @@ void pool_free(pool *p)
 void pool_zeroize(pool *p, pool_map_f f)
 {
 	void *v;
-	pool_iter_for_each(p, v) {
-		f(v);
+	if (f) {
+		pool_iter_for_each(p, v) {
+			f(v);
+		}
 	}
 	p->num = 0;
 }
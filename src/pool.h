@@ -27,7 +27,8 @@ pool *pool_new(void);
 /* func type applied to each item in a pool */
 typedef void (*pool_map_f)(void *v);
 
-/* apply f, which free an item, to all items and set num to 0 */
+/* apply f, which free an item, to all items and set num to 0. f can
+ * be NULL when items are owned by another pool. */
 void pool_zeroize(pool *p, pool_map_f f);
 
 /* free pool->array and pool */
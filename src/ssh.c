@@ -6,7 +6,9 @@
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <netdb.h>
 #include <errno.h> // Added for errno
 
 #include <ssh.h>
@@ -14,6 +16,8 @@
 #include <strerrno.h>
 #include <print.h>
 #include <netdev.h>
+#include <trace.h>
+#include <loopback.h>
 
 #include "libssh/callbacks.h"
 #include "libssh/options.h"
@@ -202,9 +206,131 @@ static struct ssh_callbacks_struct cb = {
 	.userdata = NULL,
 };
 
+static bool sockaddr_is_loopback(const struct sockaddr *sa)
+{
+	if (sa->sa_family == AF_INET)
+		return ntohl(((struct sockaddr_in *)sa)->sin_addr.s_addr) >> 24 == 127;
+	if (sa->sa_family == AF_INET6)
+		return IN6_IS_ADDR_LOOPBACK(&((struct sockaddr_in6 *)sa)->sin6_addr);
+	return false;
+}
+
+static int ssh_connect_addrinfo(struct addrinfo *ai, struct mscp_ssh_opts *opts)
+{
+	struct sockaddr_storage ss;
+	socklen_t len;
+	int sock, v = 1;
+
+	if ((sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0) {
+		priv_set_errv("socket: %s", strerrno());
+		return -1;
+	}
+
+	/* loopback addresses are not reachable via network devices */
+	if (opts->bind_dev && !sockaddr_is_loopback(ai->ai_addr)) {
+		if (setsockopt(sock, SOL_SOCKET, SO_BINDTODEVICE, opts->bind_dev,
+			       strlen(opts->bind_dev)) < 0) {
+			priv_set_errv("SO_BINDTODEVICE %s: %s", opts->bind_dev, strerrno());
+			goto close_out;
+		}
+		/* use an address of the device as the source address */
+		if (netdev_get_addr(opts->bind_dev, ai->ai_family, &ss, &len) == 0 &&
+		    bind(sock, (struct sockaddr *)&ss, len) < 0) {
+			priv_set_errv("bind to %s: %s", opts->bind_dev, strerrno());
+			goto close_out;
+		}
+	}
+
+	/* libssh does not apply socket options to a socket passed by
+	 * SSH_OPTIONS_FD */
+	if (!opts->enable_nagle &&
+	    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &v, sizeof(v)) < 0) {
+		priv_set_errv("TCP_NODELAY: %s", strerrno());
+		goto close_out;
+	}
+#ifdef TCP_CONGESTION
+	if (opts->ccalgo && setsockopt(sock, IPPROTO_TCP, TCP_CONGESTION, opts->ccalgo,
+				       strlen(opts->ccalgo)) < 0) {
+		priv_set_errv("TCP_CONGESTION %s: %s", opts->ccalgo, strerrno());
+		goto close_out;
+	}
+#endif
+
+	if (connect(sock, ai->ai_addr, ai->ai_addrlen) < 0) {
+		priv_set_errv("connect: %s", strerrno());
+		goto close_out;
+	}
+
+	return sock;
+
+close_out:
+	close(sock);
+	return -1;
+}
+
+static int ssh_connect_socket(ssh_session ssh, struct mscp_ssh_opts *opts)
+{
+	struct addrinfo hints, *res, *ai;
+	char *host = NULL, port[16];
+	unsigned int port_num = 22;
+	int sock = -1, ret;
+
+	/* libssh parses ssh_config on connecting unless parsed. parse it
+	 * here for HostName and Port. */
+	if (!opts->config && ssh_options_parse_config(ssh, NULL) < 0) {
+		priv_set_errv("failed to parse ssh_config");
+		return -1;
+	}
+
+	/* remote_addr, or the host name resolved in ssh_config */
+	if (!opts->remote_addr && ssh_options_get(ssh, SSH_OPTIONS_HOST, &host) != SSH_OK) {
+		priv_set_errv("failed to get destination host");
+		return -1;
+	}
+	ssh_options_get_port(ssh, &port_num);
+	snprintf(port, sizeof(port), "%u", port_num);
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = opts->ai_family ? opts->ai_family : AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	ret = getaddrinfo(opts->remote_addr ? opts->remote_addr : host, port, &hints, &res);
+	if (ret != 0) {
+		priv_set_errv("getaddrinfo %s: %s", opts->remote_addr ? opts->remote_addr : host,
+			      gai_strerror(ret));
+		if (host)
+			ssh_string_free_char(host);
+		return -1;
+	}
+
+	for (ai = res; ai && sock < 0; ai = ai->ai_next)
+		sock = ssh_connect_addrinfo(ai, opts);
+
+	freeaddrinfo(res);
+	if (sock < 0) {
+		/* priv_err has the error of the last address */
+		if (host)
+			ssh_string_free_char(host);
+		return -1;
+	}
+
+	pr_debug("connected to %s port %s%s%s", opts->remote_addr ? opts->remote_addr : host,
+		 port, opts->bind_dev ? " via " : "", opts->bind_dev ? opts->bind_dev : "");
+	if (host)
+		ssh_string_free_char(host);
+
+	if (ssh_options_set(ssh, SSH_OPTIONS_FD, &sock) != SSH_OK) {
+		priv_set_errv("failed to set socket");
+		close(sock);
+		return -1;
+	}
+
+	return 0;
+}
+
 static ssh_session ssh_init_session(const char *sshdst, struct mscp_ssh_opts *opts)
 {
 	ssh_session ssh = ssh_new();
+	uint64_t start;
 
 	ssh_callbacks_init(&cb);
 	cb.userdata = opts;
@@ -218,86 +344,30 @@ static ssh_session ssh_init_session(const char *sshdst, struct mscp_ssh_opts *op
 	if (ssh_set_opts(ssh, opts) != 0)
 		goto free_out;
 
-	// 方案A：自定义socket，SO_BINDTODEVICE+bind(ip)，用SSH_OPTIONS_FD传递给libssh
-	if (opts->bind_dev) {
-		struct ifreq ifr;
-		int sock = socket(AF_INET, SOCK_STREAM, 0);
-		if (sock >= 0) {
-			// 1. SO_BINDTODEVICE
-			memset(&ifr, 0, sizeof(ifr));
-			strncpy(ifr.ifr_name, opts->bind_dev, IFNAMSIZ - 1);
-			if (setsockopt(sock, SOL_SOCKET, SO_BINDTODEVICE, (void *)&ifr, sizeof(ifr)) < 0) {
-				pr_err("setsockopt SO_BINDTODEVICE %s failed: %s", opts->bind_dev, strerror(errno));
-				close(sock);
-				goto free_out;
-			}
-			// 2. 获取设备IP并bind
-			memset(&ifr, 0, sizeof(ifr));
-			strncpy(ifr.ifr_name, opts->bind_dev, IFNAMSIZ - 1);
-			if (ioctl(sock, SIOCGIFADDR, &ifr) == 0) {
-				struct sockaddr_in *sin = (struct sockaddr_in *)&ifr.ifr_addr;
-				struct sockaddr_in addr;
-				memset(&addr, 0, sizeof(addr));
-				addr.sin_family = AF_INET;
-				addr.sin_addr = sin->sin_addr;
-				addr.sin_port = 0;
-				if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-					pr_err("bind to %s failed: %s", inet_ntoa(sin->sin_addr), strerror(errno));
-					close(sock);
-					goto free_out;
-				}
-				pr_notice("SO_BINDTODEVICE+bind: %s (%s) success", opts->bind_dev, inet_ntoa(sin->sin_addr));
-				// 3. TCP connect 到目标主机
-				struct sockaddr_in remote_addr;
-				memset(&remote_addr, 0, sizeof(remote_addr));
-				remote_addr.sin_family = AF_INET;
-				remote_addr.sin_port = htons(opts->port ? atoi(opts->port) : 22);
-				// 解析目标主机 IP
-				const char *host = sshdst;
-				if (host) {
-					if (inet_pton(AF_INET, host, &remote_addr.sin_addr) <= 0) {
-						pr_err("inet_pton failed for host %s", host);
-						close(sock);
-						goto free_out;
-					}
-					if (connect(sock, (struct sockaddr *)&remote_addr, sizeof(remote_addr)) < 0) {
-						pr_err("tcp connect to %s:%d failed: %s", host, ntohs(remote_addr.sin_port), strerror(errno));
-						close(sock);
-						goto free_out;
-					}
-					pr_notice("tcp connect to %s:%d success", host, ntohs(remote_addr.sin_port));
-				} else {
-					pr_err("no host to connect");
-					close(sock);
-					goto free_out;
-				}
-				// 4. 传递socket给libssh
-				if (ssh_options_set(ssh, SSH_OPTIONS_FD, &sock) != SSH_OK) {
-					pr_err("ssh_options_set SSH_OPTIONS_FD failed");
-					close(sock);
-					goto free_out;
-				}
-				pr_notice("Custom connected socket passed to libssh");
-			}
-			else {
-				pr_err("ioctl SIOCGIFADDR %s failed: %s", opts->bind_dev, strerror(errno));
-				close(sock);
-				goto free_out;
-			}
-		}
-	}
+	/* connect the socket by ourselves to bind it to a network
+	 * device or to connect to another address of the host */
+	start = trace_begin();
+	if (opts->loopback) {
+		if (loopback_connect(ssh, opts->loopback) < 0)
+			goto free_out;
+	} else if ((opts->bind_dev || opts->remote_addr) && ssh_connect_socket(ssh, opts) < 0)
+		goto free_out;
 
 	if (ssh_connect(ssh) != SSH_OK) {
 		priv_set_errv("failed to connect ssh server: %s", ssh_get_error(ssh));
 		goto free_out;
 	}
+	trace_event("connect", start, opts->remote_addr, 0, 0);
 
+	start = trace_begin();
 	if (ssh_authenticate(ssh, opts) != 0) {
 		priv_set_errv("authentication failed: %s", ssh_get_error(ssh));
 		goto disconnect_out;
 	}
+	trace_event("auth", start, NULL, 0, 0);
 
-	if (ssh_verify_known_hosts(ssh) != 0) {
+	/* host keys of loopback are generated for each session */
+	if (!opts->loopback && ssh_verify_known_hosts(ssh) != 0) {
 		priv_set_errv("ssh_veriy_known_hosts failed");
 		goto disconnect_out;
 	}
@@ -315,6 +385,7 @@ sftp_session ssh_init_sftp_session(const char *sshdst, struct mscp_ssh_opts *opt
 {
 	sftp_session sftp;
 	ssh_session ssh = ssh_init_session(sshdst, opts);
+	uint64_t start;
 
 	if (!ssh)
 		return NULL;
@@ -325,11 +396,13 @@ sftp_session ssh_init_sftp_session(const char *sshdst, struct mscp_ssh_opts *opt
 		goto err_out;
 	}
 
+	start = trace_begin();
 	if (sftp_init(sftp) != SSH_OK) {
 		priv_set_errv("failed to initialize sftp session: err code %d",
 			      sftp_get_error(sftp));
 		goto err_out;
 	}
+	trace_event("sftp_init", start, NULL, 0, 0);
 
 	return sftp;
 err_out:
@@ -484,6 +557,21 @@ void ssh_sftp_close(sftp_session sftp)
 	ssh_free(ssh);
 }
 
+bool ssh_sftp_is_connected(sftp_session sftp)
+{
+	ssh_session ssh;
+
+	if (!sftp)
+		return false;
+
+	ssh = sftp_ssh(sftp);
+	if (!ssh_is_connected(ssh) || ssh_get_status(ssh) & (SSH_CLOSED | SSH_CLOSED_ERROR))
+		return false;
+
+	/* the sftp subsystem may exit while the ssh connection alives */
+	return ssh_channel_is_open(sftp->channel) && !ssh_channel_is_eof(sftp->channel);
+}
+
 const char **mscp_ssh_ciphers(void)
 {
 	return ssh_ciphers();
@@ -493,3 +581,11 @@ const char **mscp_ssh_hmacs(void)
 {
 	return ssh_hmacs();
 }
+
+void ssh_sftp_shutdown(sftp_session sftp)
+{
+	socket_t fd = ssh_get_fd(sftp_ssh(sftp));
+
+	if (fd != SSH_INVALID_SOCKET)
+		shutdown(fd, SHUT_RDWR);
+}
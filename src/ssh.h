@@ -14,6 +14,15 @@
 sftp_session ssh_init_sftp_session(const char *sshdst, struct mscp_ssh_opts *opts);
 void ssh_sftp_close(sftp_session sftp);
 
+/* ssh_sftp_is_connected() returns false if the underlying SSH
+ * connection or the sftp channel of the sftp session is closed. */
+bool ssh_sftp_is_connected(sftp_session sftp);
+
+/* ssh_sftp_shutdown() shuts down the socket of the sftp session so
+ * that a thread blocking on the session fails immediately. The session
+ * must still be closed by ssh_sftp_close(). */
+void ssh_sftp_shutdown(sftp_session sftp);
+
 #define sftp_ssh(sftp) (sftp)->session
 #define sftp_get_ssh_error(sftp) ssh_get_error(sftp_ssh(sftp))
 
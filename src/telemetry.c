@@ -0,0 +1,144 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+#ifdef linux
+#define _GNU_SOURCE /* RUSAGE_THREAD */
+#include <netinet/in.h>
+#include <linux/tcp.h> /* struct tcp_info of glibc lacks recent fields */
+#endif
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include <telemetry.h>
+
+/* thresholds of ratios to an interval to classify bottlenecks */
+#define TELEMETRY_WAIT_BOUND	0.5
+#define TELEMETRY_CPU_BOUND	0.9	/* of a core */
+#define TELEMETRY_DISK_BOUND	0.5
+#define TELEMETRY_RWND_BOUND	0.5
+#define TELEMETRY_IDLE		0.05
+
+static void telemetry_cpu_usec(uint64_t *utime, uint64_t *stime)
+{
+#ifdef RUSAGE_THREAD
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_THREAD, &ru) == 0) {
+		*utime = (uint64_t)ru.ru_utime.tv_sec * 1000000 + ru.ru_utime.tv_usec;
+		*stime = (uint64_t)ru.ru_stime.tv_sec * 1000000 + ru.ru_stime.tv_usec;
+		return;
+	}
+#endif
+	/* user and system time are not distinguished */
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	*utime = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	*stime = 0;
+}
+
+/* returns false if TCP_INFO is not available */
+static bool telemetry_tcp_info(struct telemetry *tm, int sock, double elapsed)
+{
+#ifdef TCP_INFO
+	struct mscp_conn_telemetry *r = &tm->result;
+	struct tcp_info ti;
+	socklen_t len = sizeof(ti);
+	uint32_t segs;
+
+	memset(&ti, 0, sizeof(ti));
+	if (sock < 0 || getsockopt(sock, IPPROTO_TCP, TCP_INFO, &ti, &len) < 0)
+		return false;
+
+	r->rtt = ti.tcpi_rtt;
+	r->rttvar = ti.tcpi_rttvar;
+	r->cwnd = ti.tcpi_snd_cwnd;
+	r->retrans = ti.tcpi_total_retrans;
+	r->pacing_rate = ti.tcpi_pacing_rate;
+	r->delivery_rate = ti.tcpi_delivery_rate; /* 0 on old kernels */
+
+	/* counters go back when the thread reconnected */
+	segs = ti.tcpi_segs_out - tm->segs_out;
+	if (ti.tcpi_segs_out >= tm->segs_out && ti.tcpi_total_retrans >= tm->retrans)
+		r->loss = segs ? (double)(ti.tcpi_total_retrans - tm->retrans) / segs : 0;
+	else
+		r->loss = 0;
+	if (ti.tcpi_rwnd_limited >= tm->rwnd_limited)
+		r->rwnd_limited = (ti.tcpi_rwnd_limited - tm->rwnd_limited) / elapsed;
+	else
+		r->rwnd_limited = 0;
+
+	tm->segs_out = ti.tcpi_segs_out;
+	tm->retrans = ti.tcpi_total_retrans;
+	tm->rwnd_limited = ti.tcpi_rwnd_limited;
+	return true;
+#else
+	return false;
+#endif
+}
+
+static int telemetry_classify(struct mscp_conn_telemetry *r)
+{
+	double cpu = r->cpu_user + r->cpu_sys;
+
+	if (r->wait >= TELEMETRY_WAIT_BOUND)
+		return MSCP_BOTTLENECK_BWLIMIT;
+	/* disk i/o on the page cache consumes system time, so check
+	 * the disk first */
+	if (r->disk >= TELEMETRY_DISK_BOUND)
+		return MSCP_BOTTLENECK_DISK;
+	if (cpu >= TELEMETRY_CPU_BOUND)
+		return MSCP_BOTTLENECK_CPU;
+	if (r->rwnd_limited >= TELEMETRY_RWND_BOUND)
+		return MSCP_BOTTLENECK_REMOTE;
+	if (cpu < TELEMETRY_IDLE && r->disk < TELEMETRY_IDLE && r->wait < TELEMETRY_IDLE)
+		return MSCP_BOTTLENECK_UNKNOWN; /* idle */
+
+	/* neither cpu, disk, nor bitrate limits, so that the thread is
+	 * waiting for the network */
+	return MSCP_BOTTLENECK_NETWORK;
+}
+
+void telemetry_sample(struct telemetry *tm, int sock, uint64_t now)
+{
+	struct mscp_conn_telemetry *r = &tm->result;
+	uint64_t utime, stime;
+	bool first = tm->last == 0;
+	double elapsed = now - tm->last;
+
+	telemetry_cpu_usec(&utime, &stime);
+	if (!telemetry_tcp_info(tm, sock, elapsed))
+		r->loss = r->rwnd_limited = 0;
+
+	if (!first) {
+		r->cpu_user = (utime - tm->utime) / elapsed;
+		r->cpu_sys = (stime - tm->stime) / elapsed;
+		r->disk = (tm->disk_usec - tm->disk) / elapsed;
+		r->wait = (tm->wait_usec - tm->wait) / elapsed;
+		r->bottleneck = telemetry_classify(r);
+		r->intervals[r->bottleneck]++;
+	}
+
+	tm->last = now;
+	tm->utime = utime;
+	tm->stime = stime;
+	tm->disk = tm->disk_usec;
+	tm->wait = tm->wait_usec;
+}
+
+const char *mscp_bottleneck_str(int bottleneck)
+{
+	static const char *names[] = {
+		[MSCP_BOTTLENECK_UNKNOWN] = "unknown",
+		[MSCP_BOTTLENECK_CPU] = "cpu",
+		[MSCP_BOTTLENECK_DISK] = "disk",
+		[MSCP_BOTTLENECK_NETWORK] = "network",
+		[MSCP_BOTTLENECK_REMOTE] = "remote",
+		[MSCP_BOTTLENECK_BWLIMIT] = "bwlimit",
+	};
+
+	if (bottleneck < 0 || bottleneck >= MSCP_BOTTLENECK_NR)
+		return "unknown";
+	return names[bottleneck];
+}
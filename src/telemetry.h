@@ -0,0 +1,44 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+#ifndef _TELEMETRY_H_
+#define _TELEMETRY_H_
+
+#include <stdint.h>
+
+#include <mscp.h>
+
+/*
+ * telemetry samples TCP_INFO of the socket of a connection and the cpu
+ * time of the copy thread every TELEMETRY_INTERVAL_USEC, and classifies
+ * the bottleneck of the connection in the interval. The cpu time of a
+ * thread can be obtained by the thread itself only, so copy threads
+ * call telemetry_tick() while copying. Time in disk i/o and sleeping
+ * for bitrate limits are accumulated into disk_usec and wait_usec by
+ * the copy thread.
+ */
+
+#define TELEMETRY_INTERVAL_USEC	1000000
+
+struct telemetry {
+	uint64_t	disk_usec;	/* time in disk reads and writes */
+	uint64_t	wait_usec;	/* time sleeping for bitrate limits */
+
+	/* values at the last sample */
+	uint64_t	last;		/* usec, 0 if not sampled yet */
+	uint64_t	utime, stime;	/* cpu time of the thread (usec) */
+	uint64_t	disk, wait;
+	uint64_t	rwnd_limited;	/* usec */
+	uint32_t	segs_out, retrans;
+
+	struct mscp_conn_telemetry	result;
+};
+
+/* sample now (usec, CLOCK_MONOTONIC), and classify the last interval */
+void telemetry_sample(struct telemetry *tm, int sock, uint64_t now);
+
+#define telemetry_tick(tm, sock, now)				\
+	do {							\
+		if ((now) - (tm)->last >= TELEMETRY_INTERVAL_USEC)	\
+			telemetry_sample(tm, sock, now);	\
+	} while (0)
+
+#endif /* _TELEMETRY_H_ */
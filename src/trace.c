@@ -0,0 +1,215 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <print.h>
+#include <strerrno.h>
+#include <trace.h>
+
+#define TRACE_BLOCK_EVENTS	4096
+#define TRACE_MAX_EVENTS	(1 << 20) /* per thread, drop more */
+
+struct trace_event {
+	const char	*name;
+	const char	*path;
+	uint64_t	ts, dur; /* usec */
+	size_t		off, len;
+};
+
+struct trace_block {
+	struct trace_block	*next;
+	int			nr;
+	struct trace_event	events[TRACE_BLOCK_EVENTS];
+};
+
+/* events of a thread, written only by the thread */
+struct trace_buf {
+	struct trace_buf	*next; /* list of all buffers */
+	int			tid;
+	char			name[32];
+	struct trace_block	*head, *tail;
+	size_t			nr_events, nr_dropped;
+};
+
+bool trace_enabled = false;
+static char *trace_path;
+static uint64_t trace_epoch;
+static struct trace_buf *trace_bufs; /* pushed by compare-and-swap */
+static int trace_nr_bufs;
+static int trace_gen; /* incremented by trace_start() */
+static __thread struct trace_buf *trace_buf;
+static __thread int trace_buf_gen; /* trace_buf is stale if not trace_gen */
+
+uint64_t trace_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int trace_start(const char *pathname)
+{
+	if (!(trace_path = strdup(pathname))) {
+		priv_set_errv("strdup: %s", strerrno());
+		return -1;
+	}
+	trace_epoch = trace_now();
+	trace_gen++;
+	trace_enabled = true;
+	return 0;
+}
+
+static struct trace_buf *trace_get_buf(void)
+{
+	struct trace_buf *b;
+
+	if (trace_buf && trace_buf_gen == trace_gen)
+		return trace_buf;
+
+	if (!(b = calloc(1, sizeof(*b))))
+		return NULL;
+	b->tid = __sync_add_and_fetch(&trace_nr_bufs, 1);
+	do {
+		b->next = trace_bufs;
+	} while (!__sync_bool_compare_and_swap(&trace_bufs, b->next, b));
+
+	trace_buf = b;
+	trace_buf_gen = trace_gen;
+	return b;
+}
+
+void trace_thread_name(const char *fmt, int id)
+{
+	struct trace_buf *b;
+
+	if (trace_enabled && (b = trace_get_buf()))
+		snprintf(b->name, sizeof(b->name), fmt, id);
+}
+
+void __trace_event(const char *name, uint64_t start, const char *path,
+		   size_t off, size_t len)
+{
+	uint64_t now = trace_now();
+	struct trace_event *e;
+	struct trace_block *k;
+	struct trace_buf *b;
+
+	if (!(b = trace_get_buf()))
+		return;
+
+	if (b->nr_events >= TRACE_MAX_EVENTS) {
+		b->nr_dropped++;
+		return;
+	}
+
+	if (!b->tail || b->tail->nr == TRACE_BLOCK_EVENTS) {
+		if (!(k = malloc(sizeof(*k)))) {
+			b->nr_dropped++;
+			return;
+		}
+		k->next = NULL;
+		k->nr = 0;
+		if (b->tail)
+			b->tail->next = k;
+		else
+			b->head = k;
+		b->tail = k;
+	}
+
+	e = &b->tail->events[b->tail->nr++];
+	e->name = name;
+	e->path = path;
+	e->ts = start - trace_epoch;
+	e->dur = now - start;
+	e->off = off;
+	e->len = len;
+	b->nr_events++;
+}
+
+static void trace_write_string(FILE *fp, const char *s)
+{
+	fputc('"', fp);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(fp, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(fp, "\\u%04x", *s);
+		else
+			fputc(*s, fp);
+	}
+	fputc('"', fp);
+}
+
+int trace_dump(void)
+{
+	struct trace_block *k, *next;
+	struct trace_buf *b, *bnext;
+	struct trace_event *e;
+	bool first = true;
+	size_t dropped = 0;
+	FILE *fp;
+	int n;
+
+	if (!trace_enabled)
+		return 0;
+	trace_enabled = false;
+
+	if (!(fp = fopen(trace_path, "w"))) {
+		priv_set_errv("fopen: %s: %s", trace_path, strerrno());
+		return -1;
+	}
+
+	fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	for (b = trace_bufs; b; b = b->next) {
+		if (b->name[0]) {
+			fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+				"\"tid\":%d,\"args\":{\"name\":", first ? "" : ",\n", b->tid);
+			trace_write_string(fp, b->name);
+			fprintf(fp, "}}");
+			first = false;
+		}
+		for (k = b->head; k; k = k->next) {
+			for (n = 0; n < k->nr; n++) {
+				e = &k->events[n];
+				fprintf(fp, "%s{\"name\":\"%s\",\"cat\":\"mscp\",\"ph\":\"X\","
+					"\"pid\":1,\"tid\":%d,\"ts\":%" PRIu64 ",\"dur\":%" PRIu64,
+					first ? "" : ",\n", e->name, b->tid, e->ts, e->dur);
+				if (e->path) {
+					fprintf(fp, ",\"args\":{\"path\":");
+					trace_write_string(fp, e->path);
+					fprintf(fp, ",\"off\":%zu,\"len\":%zu}", e->off, e->len);
+				} else if (e->len)
+					fprintf(fp, ",\"args\":{\"len\":%zu}", e->len);
+				fprintf(fp, "}");
+				first = false;
+			}
+		}
+		dropped += b->nr_dropped;
+	}
+	fprintf(fp, "\n]}\n");
+
+	if (fclose(fp) == EOF) {
+		priv_set_errv("fclose: %s: %s", trace_path, strerrno());
+		return -1;
+	}
+	if (dropped)
+		pr_warn("trace: %zu events dropped", dropped);
+	pr_notice("trace: written to %s", trace_path);
+
+	for (b = trace_bufs; b; b = bnext) {
+		bnext = b->next;
+		for (k = b->head; k; k = next) {
+			next = k->next;
+			free(k);
+		}
+		free(b);
+	}
+	trace_bufs = NULL;
+	trace_nr_bufs = 0;
+	free(trace_path);
+
+	return 0;
+}
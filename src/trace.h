@@ -0,0 +1,52 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * trace records timestamped events into per-thread buffers without
+ * locks, and dumps them in the Chrome trace event format (JSON), which
+ * chrome://tracing and Perfetto UI read. Each event is a complete
+ * event with its start and duration.
+ */
+
+extern bool trace_enabled;
+
+/* start recording events, dumped to pathname by trace_dump() */
+int trace_start(const char *pathname);
+
+/* write recorded events and free buffers. strings given to
+ * trace_event() must be valid until this. */
+int trace_dump(void);
+
+/* name the calling thread on the timeline */
+void trace_thread_name(const char *fmt, int id);
+
+/* usec since an arbitrary point */
+uint64_t trace_now(void);
+
+/* record an event that started at start (trace_now()) and ends now.
+ * name must be a static string. path, off, and len are its arguments,
+ * and path may be NULL. */
+void __trace_event(const char *name, uint64_t start, const char *path,
+		   size_t off, size_t len);
+
+#define trace_begin() (trace_enabled ? trace_now() : 0)
+
+#define trace_event(name, start, path, off, len)			\
+	do {								\
+		if (trace_enabled)					\
+			__trace_event(name, start, path, off, len);	\
+	} while (0)
+
+/* record an event only if it took min_usec or longer, i.e., stalls */
+#define trace_event_stall(name, start, min_usec, path, off, len)	\
+	do {								\
+		if (trace_enabled && trace_now() - (start) >= (min_usec)) \
+			__trace_event(name, start, path, off, len);	\
+	} while (0)
+
+#endif /* _TRACE_H_ */
@@ -10,8 +10,10 @@ import datetime
 import time
 import os
 import shutil
+import socket
+import json
 
-from subprocess import check_call, CalledProcessError
+from subprocess import check_call, check_output, call, Popen, CalledProcessError
 from util import File, check_same_md5sum
 
 
@@ -41,6 +43,15 @@ def test_usage(mscp):
 def test_invalid_chunk_size_config(mscp):
     run2ng([mscp, "-s", 8 << 20, "-S", 4 << 20])
 
+def test_invalid_coremask(mscp):
+    run2ng([mscp, "-m", "0x1g", "src", "localhost:dst"])
+
+param_invalid_device_weights = [ "eth0:0", "eth0:-1", "eth0:x", "eth0:1,eth1:" ]
+
+@pytest.mark.parametrize("device", param_invalid_device_weights)
+def test_invalid_device_weight(mscp, device):
+    run2ng([mscp, "--device", device, "src", "localhost:dst"])
+
 param_invalid_hostnames = [
     (["a:a", "b:b", "c:c"]), (["a:a", "b:b", "c"]), (["a:a", "b", "c:c"]),
     (["a", "b:b", "c:c"])
@@ -374,6 +385,176 @@ def test_bwlimit(mscp, src_prefix, dst_prefix):
     assert end - start > 7
 
 
+@pytest.mark.parametrize("src_prefix, dst_prefix", param_remote_prefix)
+def test_bwlimit_per_conn(mscp, src_prefix, dst_prefix):
+    """Copy 100MB file over 2 connections with 50Mbps each, this
+    requires 8 seconds, under the global limit not taking effect."""
+    src = File("src", size = 100 * 1024 * 1024).make()
+    dst = File("dst")
+
+    start = datetime.datetime.now().timestamp()
+    run2ok([mscp, "-vvv", "-n", 2, "-L", "1g", "--limit-conn", "50m",
+            src_prefix + "src", dst_prefix + "dst"])
+    end = datetime.datetime.now().timestamp()
+    assert check_same_md5sum(src, dst)
+    src.cleanup()
+    dst.cleanup()
+    assert end - start > 7
+
+
+@pytest.mark.parametrize("src_prefix, dst_prefix", param_remote_prefix)
+def test_bwlimit_group(mscp, src_prefix, dst_prefix):
+    """Copy two 50MB files by two processes sharing 100Mbps, this
+    requires 8 seconds."""
+    group = "pytest-{}".format(os.getpid())
+    srcs = [File("src{}".format(n), size = 50 * 1024 * 1024).make() for n in range(2)]
+    dsts = [File("dst{}".format(n)) for n in range(2)]
+
+    start = datetime.datetime.now().timestamp()
+    procs = []
+    for src, dst in zip(srcs, dsts):
+        cmd = list(map(str, [mscp, "-vvv", "-L", "100m", "--limit-group", group,
+                             src_prefix + src.path, dst_prefix + dst.path]))
+        print("cmd: {}".format(" ".join(cmd)))
+        procs.append(Popen(cmd))
+    for proc in procs:
+        assert proc.wait(timeout = 60) == 0
+    end = datetime.datetime.now().timestamp()
+
+    for src, dst in zip(srcs, dsts):
+        assert check_same_md5sum(src, dst)
+        src.cleanup()
+        dst.cleanup()
+    if os.path.exists("/dev/shm/mscp-bwlimit-" + group):
+        os.remove("/dev/shm/mscp-bwlimit-" + group)
+    assert end - start > 7
+
+
+def control(sock, cmd):
+    s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    s.connect(sock)
+    s.sendall((cmd + "\n").encode())
+    reply = s.makefile().readline().strip()
+    s.close()
+    return reply
+
+@pytest.mark.parametrize("src_prefix, dst_prefix", param_remote_prefix)
+def test_control(mscp, src_prefix, dst_prefix):
+    """Start copying 100MB file with 20Mbps (40 sec), and change the
+    transfer via the control socket: save a checkpoint, pause, resume,
+    add a connection, and remove the bitrate limit."""
+    sock = "control.sock"
+    src = File("src", size = 100 * 1024 * 1024).make()
+    dst = File("dst")
+    cmd = list(map(str, [mscp, "-vvv", "-n", 1, "-s", 8 * 1024 * 1024, "-L", "20m",
+                         "--control", sock, src_prefix + src.path, dst_prefix + dst.path]))
+    print("cmd: {}".format(" ".join(cmd)))
+    start = datetime.datetime.now().timestamp()
+    proc = Popen(cmd)
+    try:
+        for n in range(50):
+            if os.path.exists(sock):
+                break
+            time.sleep(0.1)
+        assert control(sock, "checkpoint checkpoint") == "ok"
+        assert os.path.exists("checkpoint")
+        assert control(sock, "pause") == "ok"
+        assert control(sock, "resume") == "ok"
+        assert control(sock, "threads 2") == "ok"
+        assert control(sock, "bitrate 0") == "ok"
+        assert control(sock, "bitrate x").startswith("error")
+        assert proc.wait(timeout = 60) == 0
+    finally:
+        if proc.poll() is None:
+            proc.kill()
+    end = datetime.datetime.now().timestamp()
+    assert check_same_md5sum(src, dst)
+    assert not os.path.exists(sock)
+    src.cleanup()
+    dst.cleanup()
+    os.remove("checkpoint")
+    assert end - start < 30
+
+
+@pytest.mark.parametrize("src_prefix, dst_prefix", param_remote_prefix)
+def test_metrics_file(mscp, src_prefix, dst_prefix):
+    src = File("src", size = 64 * 1024 * 1024).make()
+    dst = File("dst")
+    run2ok([mscp, "-vvv", "-n", 2, "--metrics-file", "metrics.prom",
+            src_prefix + src.path, dst_prefix + dst.path])
+    assert check_same_md5sum(src, dst)
+    metrics = {}
+    with open("metrics.prom") as f:
+        for line in f:
+            if not line.startswith("#"):
+                name, value = line.rsplit(" ", 1)
+                metrics[name] = float(value)
+    assert metrics["mscp_transferred_bytes_total"] == 64 * 1024 * 1024
+    assert metrics["mscp_remaining_bytes"] == 0
+    assert metrics["mscp_files_done"] == 1
+    assert metrics["mscp_sftp_request_latency_seconds_count"] > 0
+    src.cleanup()
+    dst.cleanup()
+    os.remove("metrics.prom")
+
+
+@pytest.mark.skipif(platform.system() != "Linux", reason = "TCP_INFO is linux only")
+@pytest.mark.parametrize("src_prefix, dst_prefix", param_remote_prefix)
+def test_telemetry(mscp, src_prefix, dst_prefix):
+    src = File("src", size = 64 * 1024 * 1024).make()
+    dst = File("dst")
+    run2ok([mscp, "-vvv", "-n", 2, "--metrics-file", "metrics.prom",
+            src_prefix + src.path, dst_prefix + dst.path])
+    assert check_same_md5sum(src, dst)
+    rtts = []
+    bottlenecks = []
+    with open("metrics.prom") as f:
+        for line in f:
+            if line.startswith("mscp_connection_rtt_seconds{"):
+                rtts.append(float(line.split()[-1]))
+            if line.startswith("mscp_connection_bottleneck{"):
+                bottlenecks.append(int(line.split()[-1]))
+    assert len(rtts) > 0 and max(rtts) > 0
+    # a connection is in one of bottleneck states
+    assert sum(bottlenecks) == len(rtts)
+    src.cleanup()
+    dst.cleanup()
+    os.remove("metrics.prom")
+
+
+@pytest.mark.parametrize("src_prefix, dst_prefix", param_remote_prefix)
+def test_bench(mscp, src_prefix, dst_prefix):
+    cmd = [mscp, "--bench", "16M", "-n", "1,2", "-a", "8,16",
+           src_prefix + "/dev/zero", dst_prefix + "/dev/null"]
+    out = check_output(list(map(str, cmd))).decode()
+    print(out)
+    lines = out.strip().split("\n")
+    assert len(lines) == 3 # header and a row for each -a
+    for line in lines[1:]:
+        values = line.split()[-2:]
+        assert len(values) == 2 and "error" not in values
+        assert all([float(v) > 0 for v in values])
+
+
+@pytest.mark.parametrize("src_prefix, dst_prefix", param_remote_prefix)
+def test_trace(mscp, src_prefix, dst_prefix):
+    src = File("src", size = 64 * 1024 * 1024).make()
+    dst = File("dst")
+    run2ok([mscp, "-vvv", "-n", 2, "-s", 1024 * 1024, "--trace", "trace.json",
+            src_prefix + src.path, dst_prefix + dst.path])
+    assert check_same_md5sum(src, dst)
+    with open("trace.json") as f:
+        events = json.load(f)["traceEvents"]
+    names = set([e["name"] for e in events])
+    for name in ["connect", "auth", "sftp_init", "chunk", "setstat"]:
+        assert name in names
+    chunks = [e for e in events if e["name"] == "chunk"]
+    assert sum([e["args"]["len"] for e in chunks]) == 64 * 1024 * 1024
+    src.cleanup()
+    dst.cleanup()
+    os.remove("trace.json")
+
+
 @pytest.mark.parametrize("src_prefix, dst_prefix", param_remote_prefix)
 @pytest.mark.parametrize("src, dst", param_single_copy)
 def test_set_port_ng(mscp, src_prefix, dst_prefix, src, dst):
@@ -446,6 +627,77 @@ def test_set_conn_interval(mscp, src_prefix, dst_prefix):
         src.cleanup()
         dst.cleanup()
 
+@pytest.mark.parametrize("src_prefix, dst_prefix", param_remote_prefix)
+def test_adaptive_conns(mscp, src_prefix, dst_prefix):
+    src = File("src", size = 256 * 1024 * 1024).make()
+    dst = File("dst")
+    run2ok([mscp, "-vvv", "--adaptive-conns", "-n", 8, "-s", 1024 * 1024,
+            src_prefix + src.path, dst_prefix + dst.path])
+    assert check_same_md5sum(src, dst)
+    src.cleanup()
+    dst.cleanup()
+
+@pytest.mark.parametrize("src_prefix, dst_prefix", param_remote_prefix)
+def test_reconnect_after_connection_lost(mscp, src_prefix, dst_prefix):
+    """Copy 100MB file with 200Mbps (4 sec), and kill the newest
+    sftp-server, used by a copy thread, in the middle of the transfer
+    """
+    src = File("src", size = 100 * 1024 * 1024).make()
+    dst = File("dst")
+    cmd = list(map(str, [mscp, "-vvv", "-n", 2, "-L", "200m",
+                         src_prefix + src.path, dst_prefix + dst.path]))
+    print("cmd: {}".format(" ".join(cmd)))
+    proc = Popen(cmd)
+    time.sleep(2)
+    call(["pkill", "-n", "sftp-server"])
+    assert proc.wait() == 0
+    assert check_same_md5sum(src, dst)
+    src.cleanup()
+    dst.cleanup()
+
+@pytest.mark.parametrize("src_prefix, dst_prefix", param_remote_prefix)
+def test_long_coremask(mscp, src_prefix, dst_prefix):
+    """coremask longer than 64 bits, bits for cores that do not exist
+    are ignored"""
+    src = File("src", size = 1024 * 1024).make()
+    dst = File("dst")
+    run2ok([mscp, "-vvv", "-m", "0x" + "1" * 32, src_prefix + src.path, dst_prefix + dst.path])
+    assert check_same_md5sum(src, dst)
+    src.cleanup()
+    dst.cleanup()
+
+@pytest.mark.parametrize("src_prefix, dst_prefix", param_remote_prefix)
+def test_remote_addrs(mscp, src_prefix, dst_prefix):
+    src = File("src", size = 64 * 1024 * 1024).make()
+    dst = File("dst")
+    run2ok([mscp, "-vvv", "-n", 4, "-s", 1024 * 1024, "--remote-addrs", "127.0.0.1,localhost",
+            src_prefix + src.path, dst_prefix + dst.path])
+    assert check_same_md5sum(src, dst)
+    src.cleanup()
+    dst.cleanup()
+
+@pytest.mark.parametrize("src_prefix, dst_prefix", param_remote_prefix)
+def test_stalled_connection_handed_off(mscp, src_prefix, dst_prefix):
+    """Copy 100MB file with 200Mbps (4 sec), and stop the newest
+    sftp-server in the middle of the transfer. The watchdog tears down
+    the stalled connection and another one takes over its chunk.
+    """
+    src = File("src", size = 100 * 1024 * 1024).make()
+    dst = File("dst")
+    cmd = list(map(str, [mscp, "-vvv", "-n", 2, "-L", "200m", "--stall-timeout", 2,
+                         src_prefix + src.path, dst_prefix + dst.path]))
+    print("cmd: {}".format(" ".join(cmd)))
+    proc = Popen(cmd)
+    time.sleep(2)
+    call(["pkill", "-STOP", "-n", "sftp-server"])
+    try:
+        assert proc.wait(timeout = 60) == 0
+    finally:
+        call(["pkill", "-CONT", "sftp-server"])
+    assert check_same_md5sum(src, dst)
+    src.cleanup()
+    dst.cleanup()
+
 compressions = ["yes", "no", "none"]
 @pytest.mark.parametrize("src_prefix, dst_prefix", param_remote_prefix)
 @pytest.mark.parametrize("compress", compressions)